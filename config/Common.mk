@@ -16,7 +16,7 @@ default: all
 endif
 
 CFLAGS= $(CPPFLAGS) $(DEFS) $(ARCHFLAGS) $(GENFLAGS) $(OPTFLAGS) $(WARNFLAGS)
-SRC=torque-launch.c task-mgr.c node-mgr.c
+SRC=torque-launch.c task-mgr.c node-mgr.c queue-mgr.c stream.c topology.c bucket.c simulate.c
 OBJ=$(SRC:.c=.o)
 
 vpath %.c ../src
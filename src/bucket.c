@@ -0,0 +1,119 @@
+
+/*
+ * Torque task list launcher tool.
+ *
+ * Copyright (c) 2015,2017 Axel Kohlmeyer <akohlmey@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "bucket.h"
+
+/** lowest rate the adaptive control will go down to */
+#define BUCKET_MINRATE 1.0
+
+/* ---------------------------------------- */
+
+static double bucket_time()
+{
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (double)tv.tv_sec + 1.0e-6*(double)tv.tv_usec;
+}
+
+/* ---------------------------------------- */
+
+static void bucket_refill(bucket_t *b)
+{
+    double now = bucket_time();
+    b->tokens += b->rate*(now - b->last);
+    if (b->tokens > b->burst) b->tokens = b->burst;
+    b->last = now;
+}
+
+/* ---------------------------------------- */
+
+void bucket_init(bucket_t *b, double rate)
+{
+    if (b == NULL) return;
+    b->rate = (rate > 0.0) ? rate : 0.0;
+    b->burst = (b->rate > 1.0) ? b->rate : 1.0;
+    b->tokens = b->burst;
+    b->last = bucket_time();
+}
+
+/* ---------------------------------------- */
+
+void bucket_rate(bucket_t *b, double rate)
+{
+    if (b == NULL) return;
+    bucket_refill(b);
+    b->rate = (rate > 0.0) ? rate : 0.0;
+    b->burst = (b->rate > 1.0) ? b->rate : 1.0;
+    if (b->tokens > b->burst) b->tokens = b->burst;
+}
+
+/* ---------------------------------------- */
+
+int bucket_ready(bucket_t *b)
+{
+    if ((b == NULL) || (b->rate == 0.0)) return 1;
+    bucket_refill(b);
+    return (b->tokens >= 1.0);
+}
+
+/* ---------------------------------------- */
+
+void bucket_take(bucket_t *b)
+{
+    if ((b == NULL) || (b->rate == 0.0)) return;
+    b->tokens -= 1.0;
+}
+
+/* ---------------------------------------- */
+
+double bucket_delay(bucket_t *b)
+{
+    if ((b == NULL) || (b->rate == 0.0)) return 0.0;
+    bucket_refill(b);
+    if (b->tokens >= 1.0) return 0.0;
+    return (1.0 - b->tokens)/b->rate;
+}
+
+/* ---------------------------------------- */
+
+void bucket_adapt(bucket_t *b, double latency, double target,
+                  double maxrate, int limited)
+{
+    double rate;
+
+    if ((b == NULL) || (latency <= 0.0) || (target <= 0.0)) return;
+    if (maxrate < BUCKET_MINRATE) maxrate = BUCKET_MINRATE;
+
+    /* multiplicative decrease, fast increase while far below target.
+       a rate that did not hold back any launch is not raised, or it
+       would grow without bounds while the tasks run. */
+    rate = b->rate;
+    if (latency > target)
+        rate *= 0.5;
+    else if (!limited)
+        return;
+    else if (latency < 0.5*target)
+        rate *= 1.5;
+    else
+        rate += 1.0;
+
+    /* written so that NaN ends up at the lower limit */
+    if (!(rate >= BUCKET_MINRATE)) rate = BUCKET_MINRATE;
+    if (rate > maxrate) rate = maxrate;
+    bucket_rate(b,rate);
+}
+
+/*
+ * Local Variables:
+ * c-basic-offset: 4
+ * auto-revert-buffer: 't
+ * compile-command: "make -k -C ../ fedora"
+ * End:
+ */
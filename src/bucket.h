@@ -0,0 +1,70 @@
+
+/*
+ * Torque task list launcher tool.
+ *
+ * Copyright (c) 2015,2017 Axel Kohlmeyer <akohlmey@gmail.com>
+ */
+
+/* API for token buckets to limit the rate of task launches */
+
+#ifndef TL_BUCKET_H
+#define TL_BUCKET_H
+
+typedef struct {
+    double rate;        /* tokens added per second, 0 means unlimited */
+    double burst;       /* maximum number of tokens */
+    double tokens;      /* number of available tokens */
+    double last;        /* time of last refill */
+} bucket_t;
+
+/*! Initialize a token bucket, initially full.
+ * The bucket holds up to one second worth of tokens, but at least one.
+ * \param b token bucket
+ * \param rate tokens per second, 0 for unlimited
+ */
+void bucket_init(bucket_t *b, double rate);
+
+/*! Change the rate of a token bucket
+ * \param b token bucket
+ * \param rate tokens per second, 0 for unlimited
+ */
+void bucket_rate(bucket_t *b, double rate);
+
+/*! Check whether a token is available
+ * \param b token bucket
+ * \return 1 if a token is available, 0 if not
+ */
+int bucket_ready(bucket_t *b);
+
+/*! Remove a token from the bucket
+ * \param b token bucket
+ */
+void bucket_take(bucket_t *b);
+
+/*! Return time until the next token becomes available
+ * \param b token bucket
+ * \return time in seconds
+ */
+double bucket_delay(bucket_t *b);
+
+/*! Adapt rate to an observed latency. The rate is halved when the
+ * latency exceeds the target. It is raised when the latency is below
+ * the target, but only if the rate actually held back launches.
+ * \param b token bucket
+ * \param latency observed latency in seconds, 0 if unknown
+ * \param target target latency in seconds
+ * \param maxrate upper limit for the rate, must be positive
+ * \param limited nonzero if launches had to wait for tokens recently
+ */
+void bucket_adapt(bucket_t *b, double latency, double target,
+                  double maxrate, int limited);
+
+#endif
+
+/*
+ * Local Variables:
+ * c-basic-offset: 4
+ * auto-revert-buffer: 't
+ * compile-command: "make -k -C ../ fedora"
+ * End:
+ */
@@ -5,10 +5,12 @@
  * Copyright (c) 2015,2017 Axel Kohlmeyer <akohlmey@gmail.com>
  */
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/time.h>
 
 #ifdef USE_SYSLOG
 #include <syslog.h>
@@ -20,15 +22,382 @@
 #define NODE_IDLE 0
 #define NODE_EXEC 1
 #define NODE_BUSY 2
+#define NODE_HELD 3     /* used by a multi-core task from a lower slot */
+
+/** minimum number of consecutive failed tasks before quarantine */
+#define QUARANTINE_MINFAIL 5
+/** other hosts must have a lower recent fraction of failed tasks */
+#define QUARANTINE_RATE 0.8
+/** weight of older tasks in the recent statistics of a host */
+#define QUARANTINE_DECAY 0.9
+/** failed tasks must run shorter than this fraction of the peer average */
+#define QUARANTINE_SPEED 0.1
+
+/** maximum length of host name in node file */
+#define HOSTNAMESZ 256
+/** maximum length of current working directory */
+#define CWDSZ 2048
+/** maximum length of list of input files of a task */
+#define INPUTSZ 2048
+/** maximum length of the value of the cores annotation */
+#define CORESSZ 16
 
 extern char **environ;
 
 static const char *status[] = {
-    "idle", "exec", "busy", NULL
+    "idle", "exec", "busy", "held", NULL
 };
 
 /* ---------------------------------------- */
 
+static double wall_time()
+{
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (double)tv.tv_sec + 1.0e-6*(double)tv.tv_usec;
+}
+
+/* ---------------------------------------- */
+
+/* assign slots to physical hosts. the node ids from tm_nodeinfo()
+   follow the order of the lines in $PBS_NODEFILE. without node file
+   each slot is treated as a separate host. */
+static int node_mgr_hosts(node_mgr_t *n)
+{
+    FILE *fp;
+    const char *file;
+    char name[HOSTNAMESZ];
+    int i,j,len;
+
+    n->host = (host_t *)calloc(n->nall > 0 ? n->nall : 1,sizeof(host_t));
+    if (n->host == NULL) return 1;
+    n->nhost = 0;
+
+    file = getenv("PBS_NODEFILE");
+    fp = (file != NULL) ? fopen(file,"r") : NULL;
+
+    for (i = 0; i < n->nall; ++i) {
+        len = 0;
+        if ((fp != NULL) && (fgets(name,HOSTNAMESZ,fp) != NULL)) {
+            len = strlen(name);
+            while ((len > 0) && (name[len-1] <= ' ')) name[--len] = '\0';
+        }
+        if (len == 0) snprintf(name,HOSTNAMESZ,"slot%d",n->nodeid[i]);
+
+        for (j = 0; j < n->nhost; ++j)
+            if (strcmp(n->host[j].name,name) == 0) break;
+        if (j == n->nhost) {
+            n->host[j].name = strdup(name);
+            if (n->host[j].name == NULL) break;
+            n->host[j].slot = i;
+            n->nhost++;
+        }
+        n->node[i].host = j;
+        n->node[i].local = n->host[j].nslots;
+        n->host[j].nslots++;
+        n->host[j].nidle++;
+    }
+    if (fp != NULL) fclose(fp);
+    return (i < n->nall) ? 1 : 0;
+}
+
+/* ---------------------------------------- */
+
+static void node_mgr_free_hosts(node_mgr_t *n)
+{
+    int i;
+    if (n->host == NULL) return;
+    for (i = 0; i < n->nhost; ++i)
+        free((void *)n->host[i].name);
+    free((void *)n->host);
+}
+
+/* ---------------------------------------- */
+
+/* return host of the slot with the given node id */
+static host_t *node_mgr_host(node_mgr_t *n, tm_node_id id)
+{
+    int i;
+    for (i = 0; i < n->nall; ++i)
+        if (n->nodeid[i] == id) return n->host + n->node[i].host;
+    return NULL;
+}
+
+/* ---------------------------------------- */
+
+/* put host into quarantine, if its latest tasks all failed much faster
+   than the recent tasks on the other hosts. only recent behavior counts,
+   so a host that breaks in the middle of a job is detected as well.
+   running tasks on other hosts are included with their current runtime,
+   so a broken host can be detected before any other task has completed. */
+static int node_mgr_check_host(node_mgr_t *n, int h)
+{
+    host_t *host = n->host + h;
+    double now, npeer, pfail, tpeer, tfail;
+    int i, nleft;
+
+    if (host->quarantine) return 0;
+    if (host->nstreak < QUARANTINE_MINFAIL) return 0;
+
+    /* never quarantine the last usable host */
+    nleft = 0;
+    for (i = 0; i < n->nhost; ++i)
+        if (!n->host[i].quarantine) ++nleft;
+    if (nleft < 2) return 0;
+
+    npeer = pfail = tpeer = 0.0;
+    for (i = 0; i < n->nhost; ++i) {
+        if ((i == h) || n->host[i].quarantine) continue;
+        npeer += n->host[i].rdone;
+        pfail += n->host[i].rfail;
+        tpeer += n->host[i].rtime;
+    }
+    now = wall_time();
+    for (i = 0; i < n->nall; ++i) {
+        if ((n->node[i].host == h) || (n->node[i].status == NODE_IDLE)
+            || (n->node[i].status == NODE_HELD)
+            || n->host[n->node[i].host].quarantine) continue;
+        npeer += 1.0;
+        tpeer += now - n->node[i].start;
+    }
+
+    /* failures everywhere point to the tasks, not the host */
+    if ((npeer == 0.0) || (pfail >= QUARANTINE_RATE*npeer)) return 0;
+    tfail = host->tstreak/host->nstreak;
+    if (tfail >= QUARANTINE_SPEED*tpeer/npeer) return 0;
+
+    host->quarantine = 1;
+    n->nidle -= host->nidle;
+    printf("Quarantining host %s: last %d tasks failed after %.3gs "
+           "on average (other hosts: %.3gs)\n",host->name,host->nstreak,
+           tfail,tpeer/npeer);
+#ifdef USE_SYSLOG
+    syslog(LOG_WARNING,"{\"job_id\": %s, \"event\": \"quarantine\","
+           "\"host\": \"%s\", \"num_failed\": %d, \"num_done\": %d}",
+           pbsjobid,host->name,host->nfail,host->ndone);
+#endif
+    return 1;
+}
+
+/* ---------------------------------------- */
+
+/* prefix shell command with a change to the current working directory */
+static char *node_mgr_cwdcmd(const char *cmd)
+{
+    char cwd[CWDSZ];
+    char *buf;
+    size_t len;
+
+    if (getcwd(cwd,CWDSZ) == NULL) strcpy(cwd,".");
+    len = strlen(cwd) + strlen(cmd) + 8;
+    buf = (char *)malloc(len);
+    if (buf != NULL) snprintf(buf,len,"cd %s ; %s",cwd,cmd);
+    return buf;
+}
+
+/* ---------------------------------------- */
+
+static int is_pathchar(char c)
+{
+    return (c != '\0') && (isalnum((unsigned char)c)
+                           || (strchr("._-+~/",c) != NULL));
+}
+
+/* replace all occurrences of path p in cmd by dir/basename(p) */
+static char *node_mgr_rewrite(char *cmd, const char *p, const char *dir)
+{
+    const char *base,*ptr,*hit;
+    char *buf,*out;
+    size_t plen,nlen;
+    int num;
+
+    plen = strlen(p);
+    if (plen == 0) return cmd;
+    base = strrchr(p,'/');
+    base = (base != NULL) ? base+1 : p;
+    nlen = strlen(dir) + strlen(base) + 1;
+
+    /* only replace complete paths, not parts of longer ones */
+    num = 0;
+    for (ptr = cmd; (hit = strstr(ptr,p)) != NULL; ptr = hit + plen)
+        if (((hit == cmd) || !is_pathchar(hit[-1])) && !is_pathchar(hit[plen]))
+            ++num;
+    if (num == 0) return cmd;
+
+    buf = (char *)malloc(strlen(cmd) + num*nlen + 1);
+    if (buf == NULL) return cmd;
+    out = buf;
+    for (ptr = cmd; (hit = strstr(ptr,p)) != NULL; ptr = hit + plen) {
+        memcpy(out,ptr,hit-ptr);
+        out += hit-ptr;
+        if (((hit == cmd) || !is_pathchar(hit[-1])) && !is_pathchar(hit[plen]))
+            out += sprintf(out,"%s/%s",dir,base);
+        else {
+            memcpy(out,hit,plen);
+            out += plen;
+        }
+    }
+    strcpy(out,ptr);
+    free((void *)cmd);
+    return buf;
+}
+
+/* ---------------------------------------- */
+
+/* build the shell command for a task. with staged input files, paths
+   of input files are replaced by their staged copies, the location is
+   exported as $TL_STAGE_DIR, and the copies are removed afterwards. */
+static char *node_mgr_command(node_mgr_t *n, const task_t *t, int staged)
+{
+    char inputs[INPUTSZ],dir[CWDSZ],cwd[CWDSZ];
+    char *cmd,*tok,*buf;
+    const char *nl;
+    size_t len;
+
+    if (!staged || (task_annotation(t,"input",inputs,INPUTSZ) == NULL))
+        return node_mgr_cwdcmd(t->cmd);
+
+    snprintf(dir,CWDSZ,"%s/task%d",n->stagedir,t->tasknum);
+    cmd = strdup(t->cmd);
+    if (cmd == NULL) return NULL;
+    for (tok = strtok(inputs,","); tok != NULL; tok = strtok(NULL,","))
+        cmd = node_mgr_rewrite(cmd,tok,dir);
+
+    if (getcwd(cwd,CWDSZ) == NULL) strcpy(cwd,".");
+    len = strlen(cmd);
+    nl = ((len > 0) && (cmd[len-1] == '\n')) ? "" : "\n";
+    len += strlen(cwd) + 2*strlen(dir) + 96;
+    buf = (char *)malloc(len);
+    if (buf != NULL)
+        snprintf(buf,len,"cd %s ; TL_STAGE_DIR=%s ; export TL_STAGE_DIR ; "
+                 "%s%src=$? ; rm -rf %s ; exit $rc\n",cwd,dir,cmd,nl,dir);
+    free((void *)cmd);
+    return buf;
+}
+
+/* ---------------------------------------- */
+
+/* wrapper script that runs the task command, passed as $0, through
+   this program in binding mode. the task runs unbound with a message,
+   if the program is not available on the host. */
+static char *node_mgr_bind(node_mgr_t *n, const task_t *t, int i, int num)
+{
+    char *buf;
+    size_t len;
+
+    len = 2*strlen(n->bindexe) + 256;
+    buf = (char *)malloc(len);
+    if (buf != NULL)
+        snprintf(buf,len,"if [ -x '%s' ] ; then exec '%s' --bind=%d-%d/%d "
+                 "--task=%d %s-- /bin/sh -c \"$0\" ; fi ; "
+                 "echo \"torque-launch: cannot bind task %d, '%s' not found "
+                 "on `hostname`\" >&2 ; exec /bin/sh -c \"$0\"",
+                 n->bindexe,n->bindexe,n->node[i].local,
+                 n->node[i].local+num-1,
+                 n->host[n->node[i].host].nslots,t->tasknum,
+                 n->bindlog ? "-l " : "",t->tasknum,n->bindexe);
+    return buf;
+}
+
+/* ---------------------------------------- */
+
+/* run a staging command on a host. t is NULL for cleanup commands. */
+static int node_mgr_stage_spawn(node_mgr_t *n, task_t *t, int h,
+                                const char *cmd)
+{
+    stage_t *s;
+    char *job[3];
+    int i,rv;
+
+    for (i = 0; i < n->maxstage; ++i)
+        if (n->stage[i].status == NODE_IDLE) break;
+    if (i == n->maxstage) return 1;
+    s = n->stage + i;
+
+    job[0] = (char *)"/bin/sh";
+    job[1] = (char *)"-c";
+    job[2] = node_mgr_cwdcmd(cmd);
+    if (job[2] == NULL) return 1;
+    rv = tm_spawn(3,job,environ,n->nodeid[n->host[h].slot],
+                  &(s->taskid),&(s->event));
+    free((void *)job[2]);
+    if (rv != TM_SUCCESS) return 1;
+
+    s->task = t;
+    s->ntry = (t != NULL) ? t->ntry : 0;
+    s->host = h;
+    s->status = NODE_EXEC;
+    n->nstage++;
+    return 0;
+}
+
+/* ---------------------------------------- */
+
+/* copy input files of a task to the staging directory on a host */
+static int node_mgr_copy(node_mgr_t *n, task_t *t, int h, char *inputs)
+{
+    char *cmd,*tok,*ptr;
+    int rv;
+
+    cmd = (char *)malloc(3*strlen(inputs) + 2*strlen(n->stagedir) + 64);
+    if (cmd == NULL) return 1;
+    ptr = cmd + sprintf(cmd,"mkdir -p %s/task%d && cp -p",
+                        n->stagedir,t->tasknum);
+    for (tok = strtok(inputs,","); tok != NULL; tok = strtok(NULL,","))
+        ptr += sprintf(ptr," '%s'",tok);
+    sprintf(ptr," %s/task%d/",n->stagedir,t->tasknum);
+
+    rv = node_mgr_stage_spawn(n,t,h,cmd);
+    free((void *)cmd);
+    if (rv != 0) return rv;
+
+    t->stage = STAGE_COPY;
+    t->stagehost = h;
+    n->host[h].nstaged++;
+    return 0;
+}
+
+/* ---------------------------------------- */
+
+/* remove staged input files of a task that will not be used */
+static void node_mgr_discard(node_mgr_t *n, int h, int tasknum)
+{
+    char *cmd;
+
+    cmd = (char *)malloc(strlen(n->stagedir) + 32);
+    if (cmd == NULL) return;
+    sprintf(cmd,"rm -rf %s/task%d",n->stagedir,tasknum);
+    if (node_mgr_stage_spawn(n,NULL,h,cmd) != 0)
+        printf("Staged input files of task %d on host %s are kept until "
+               "the end of the job\n",tasknum,n->host[h].name);
+    free((void *)cmd);
+}
+
+/* ---------------------------------------- */
+
+/* wait for pending copies and remove staged files from all hosts */
+static void node_mgr_unstage(node_mgr_t *n)
+{
+    char *cmd;
+    int h;
+
+    if (n->stagedir == NULL) return;
+    while (n->nstage > 0)
+        if (!node_mgr_schedule(n,NULL,1)) break;
+
+    cmd = (char *)malloc(strlen(n->stagedir) + 16);
+    if (cmd == NULL) return;
+    sprintf(cmd,"rm -rf %s",n->stagedir);
+    for (h = 0; h < n->nhost; ++h)
+        node_mgr_stage_spawn(n,NULL,h,cmd);
+    free((void *)cmd);
+
+    while (n->nstage > 0)
+        if (!node_mgr_schedule(n,NULL,1)) break;
+}
+
+/* ---------------------------------------- */
+
 node_mgr_t *node_mgr_init()
 {
     int i;
@@ -50,9 +419,24 @@ node_mgr_t *node_mgr_init()
 
     tm_nodeinfo(&(n->nodeid),&(n->nall));
     n->nrun = 0;
+    n->nidle = n->nall;
+    n->limit = 0;
+    n->nspawn = 0;
+    n->tspawn = 0.0;
+    n->bindlog = 0;
+    n->bindexe = NULL;
+    n->depth = 0;
+    n->nstage = 0;
+    n->maxstage = 0;
+    n->stagedir = NULL;
+    n->queue = NULL;
+    n->stage = NULL;
+    n->host = NULL;
     n->node = (node_t *)calloc(n->nall,sizeof(node_t));
-    if (n->node == NULL) {
+    if ((n->node == NULL) || (node_mgr_hosts(n) != 0)) {
         tm_finalize();
+        node_mgr_free_hosts(n);
+        free((void *)n->node);
         free((void *)n->nodeid);
         free((void *)n);
         return NULL;
@@ -65,6 +449,11 @@ node_mgr_t *node_mgr_init()
 void node_mgr_exit(node_mgr_t *n)
 {
     if (n == NULL) return;
+    node_mgr_unstage(n);
+    free((void *)n->bindexe);
+    node_mgr_free_hosts(n);
+    free((void *)n->stagedir);
+    free((void *)n->stage);
     free((void *)n->node);
     tm_finalize();
     free((void *)n->nodeid);
@@ -73,37 +462,303 @@ void node_mgr_exit(node_mgr_t *n)
 
 /* ---------------------------------------- */
 
+int node_mgr_binding(node_mgr_t *n, int report)
+{
+    char exe[CWDSZ];
+    ssize_t len;
+
+    if (n == NULL) return 1;
+
+    /* this program is run on each host to bind the tasks there,
+       so it has to be available under the same path everywhere */
+    len = readlink("/proc/self/exe",exe,CWDSZ-1);
+    if (len <= 0) return 2;
+    exe[len] = '\0';
+    if (strchr(exe,'\'') != NULL) return 3;
+    n->bindexe = strdup(exe);
+    if (n->bindexe == NULL) return 4;
+
+    printf("Binding tasks to CPU cores according to the topology "
+           "of each host.\n");
+    n->bindlog = report;
+    return 0;
+}
+
+/* ---------------------------------------- */
+
+void node_mgr_sharing(node_mgr_t *n, queue_mgr_t *q)
+{
+    if (n == NULL) return;
+    n->queue = q;
+}
+
+/* ---------------------------------------- */
+
+void node_mgr_limit(node_mgr_t *n, double rate)
+{
+    int i;
+    if (n == NULL) return;
+    for (i = 0; i < n->nhost; ++i)
+        bucket_init(&(n->host[i].launch),rate);
+    n->limit = (rate > 0.0);
+}
+
+/* ---------------------------------------- */
+
+int node_mgr_staging(node_mgr_t *n, const char *scratch, int depth)
+{
+    char tag[HOSTNAMESZ];
+    const char *id;
+    int i;
+
+    if ((n == NULL) || (scratch == NULL) || (depth < 1)) return 1;
+
+    /* one directory per job, so concurrent jobs do not collide */
+    id = getenv("PBS_JOBID");
+    if (id != NULL) snprintf(tag,HOSTNAMESZ,"%s",id);
+    else snprintf(tag,HOSTNAMESZ,"%d",(int)getpid());
+    for (i = 0; tag[i] != '\0'; ++i)
+        if (!is_pathchar(tag[i]) || (tag[i] == '/')) tag[i] = '_';
+
+    n->stagedir = (char *)malloc(strlen(scratch) + strlen(tag) + 16);
+    /* room for copies plus cleanup of abandoned copies on each host */
+    n->maxstage = (depth + 2)*n->nhost;
+    n->stage = (stage_t *)calloc(n->maxstage,sizeof(stage_t));
+    if ((n->stagedir == NULL) || (n->stage == NULL)) {
+        free((void *)n->stagedir);
+        free((void *)n->stage);
+        n->stagedir = NULL;
+        n->stage = NULL;
+        n->maxstage = 0;
+        return 2;
+    }
+    sprintf(n->stagedir,"%s/torque-launch.%s",scratch,tag);
+    n->depth = depth;
+    return 0;
+}
+
+/* ---------------------------------------- */
+
+void node_mgr_prefetch(node_mgr_t *n, task_mgr_t *tl)
+{
+    char inputs[INPUTSZ];
+    task_t *t;
+    int i,j,h,nactive;
+
+    if ((n == NULL) || (n->stagedir == NULL)) return;
+
+    nactive = 0;
+    for (j = 0; j < n->nhost; ++j)
+        if (!n->host[j].quarantine) ++nactive;
+
+    /* the first tasks are launched into idle slots right away */
+    for (i = n->nidle; i < n->nidle + n->depth*nactive; ++i) {
+        t = task_mgr_peek(tl,i);
+        if (t == NULL) break;
+        if (t->stage != STAGE_UNKNOWN) continue;
+        if ((task_annotation(t,"input",inputs,INPUTSZ) == NULL)
+            || (strchr(inputs,'\'') != NULL)) {
+            t->stage = STAGE_NONE;
+            continue;
+        }
+
+        /* pick the usable host with the fewest staged tasks */
+        h = -1;
+        for (j = 0; j < n->nhost; ++j) {
+            if (n->host[j].quarantine || (n->host[j].nstaged >= n->depth))
+                continue;
+            if ((h < 0) || (n->host[j].nstaged < n->host[h].nstaged)) h = j;
+        }
+        if (h < 0) break;
+        if (node_mgr_copy(n,t,h,inputs) != 0) break;
+    }
+}
+
+/* ---------------------------------------- */
+
+/* number of adjacent slots requested by a task with a "cores" annotation.
+   it is limited to the size of the largest usable host. */
+static int node_mgr_ncores(node_mgr_t *n, const task_t *t)
+{
+    char value[CORESSZ];
+    int i,num,max;
+
+    if (task_annotation(t,"cores",value,CORESSZ) == NULL) return 1;
+    num = atoi(value);
+    max = 1;
+    for (i = 0; i < n->nhost; ++i)
+        if (!n->host[i].quarantine && (n->host[i].nslots > max))
+            max = n->host[i].nslots;
+    if (num > max) num = max;
+    return (num > 1) ? num : 1;
+}
+
+/* ---------------------------------------- */
+
+/* check whether num adjacent slots starting at slot i are idle and
+   belong to the same usable host */
+static int node_mgr_fits(node_mgr_t *n, int i, int num)
+{
+    host_t *h;
+    int j;
+
+    if (i + num > n->nall) return 0;
+    h = n->host + n->node[i].host;
+    if (h->quarantine || (h->nidle < num)) return 0;
+    if (n->limit && !bucket_ready(&(h->launch))) return 0;
+    for (j = i; j < i + num; ++j) {
+        if ((n->node[j].status != NODE_IDLE)
+            || (n->node[j].host != n->node[i].host)
+            || (n->node[j].local != n->node[i].local + j - i)) return 0;
+    }
+    return 1;
+}
+
+/* ---------------------------------------- */
+
+/* select the first slot for a task, or return n->nall if it does
+   not fit on the idle slots right now */
+static int node_mgr_place(node_mgr_t *n, const task_t *t)
+{
+    host_t *avoid;
+    int i,j,num;
+
+    num = node_mgr_ncores(n,t);
+
+    /* prefer the host with the staged input files of this task */
+    if (t->stage == STAGE_READY) {
+        for (i = n->host[t->stagehost].slot; i < n->nall; ++i)
+            if ((n->node[i].host == t->stagehost) && node_mgr_fits(n,i,num))
+                return i;
+    }
+
+    /* otherwise use the first idle slot, but try to avoid the host
+       of a failed previous attempt of the same task */
+    avoid = (t->ntry > 0) ? node_mgr_host(n,t->nodeid) : NULL;
+    j = n->nall;
+    for (i = 0; i < n->nall; ++i) {
+        if (!node_mgr_fits(n,i,num)) continue;
+        if (j == n->nall) j = i;
+        if (n->host + n->node[i].host != avoid) return i;
+    }
+    return j;
+}
+
+/* ---------------------------------------- */
+
+/* take a task from the queue, if it fits on the idle slots. a retry
+   whose delay just expired is only moved to the queue by
+   task_mgr_take(), so it is checked afterwards and queued again. */
+static task_t *node_mgr_take(node_mgr_t *n, task_mgr_t *tl, int num)
+{
+    task_t *t;
+
+    t = task_mgr_peek(tl,num);
+    if ((t != NULL) && (node_mgr_place(n,t) == n->nall)) return NULL;
+    t = task_mgr_take(tl,num);
+    if ((t != NULL) && (node_mgr_place(n,t) == n->nall)) {
+        task_mgr_queue(tl,t->tasknum);
+        return NULL;
+    }
+    return t;
+}
+
+/* ---------------------------------------- */
+
+task_t *node_mgr_next(node_mgr_t *n, task_mgr_t *tl)
+{
+    task_t *t;
+    host_t *h;
+    int i,j,num,other;
+
+    if (n == NULL) return task_mgr_next(tl);
+
+    /* a multi-core task waits at the head of the queue until enough
+       adjacent slots are idle, so it is not starved by smaller tasks */
+    if (n->stagedir == NULL) return node_mgr_take(n,tl,0);
+
+    /* look through the tasks that are considered for staging */
+    num = n->nidle + n->depth*n->nhost;
+    other = -1;
+    for (i = 0; i < num; ++i) {
+        t = task_mgr_peek(tl,i);
+        if (t == NULL) break;
+        if ((t->stage != STAGE_COPY) && (t->stage != STAGE_READY)) {
+            if (other < 0) other = i;
+            continue;
+        }
+        h = n->host + t->stagehost;
+        if ((t->stage == STAGE_READY) && !h->quarantine && (h->nidle > 0)
+            && bucket_ready(&(h->launch))) {
+            j = node_mgr_place(n,t);
+            if ((j < n->nall) && (n->node[j].host == t->stagehost))
+                return task_mgr_take(tl,i);
+        }
+    }
+
+    /* all tasks in the window are staged on busy hosts */
+    if ((other < 0) && (i == num) && (task_mgr_peek(tl,num) != NULL))
+        other = num;
+    return node_mgr_take(n,tl,(other < 0) ? 0 : other);
+}
+
+/* ---------------------------------------- */
+
 tm_node_id node_mgr_run(node_mgr_t *n, task_t *t)
 {
-    int i, rv;
+    int i, j, num, rv, staged;
     tm_node_id id;
     char *wdcmd;
-    char *job[3];
+    char *job[4];
 
     if ((n == NULL) || (t == NULL)) return TM_ERROR_NODE;
 
-    wdcmd = (char *)malloc(4096);
+    i = node_mgr_place(n,t);
+    if (i == n->nall) return TM_ERROR_NODE;
+    num = node_mgr_ncores(n,t);
+
+    staged = (t->stage == STAGE_READY) && (n->node[i].host == t->stagehost);
+    if ((t->stage == STAGE_COPY) || (t->stage == STAGE_READY)) {
+        n->host[t->stagehost].nstaged--;
+        /* an unfinished copy is removed when it completes */
+        if ((t->stage == STAGE_READY) && !staged)
+            node_mgr_discard(n,t->stagehost,t->tasknum);
+        t->stage = STAGE_UNKNOWN;
+    }
+    wdcmd = node_mgr_command(n,t,staged);
     if (wdcmd == NULL) return TM_ERROR_NODE;
-    wdcmd[0] = '\0';
-    strcat(wdcmd,"cd ");
-    getcwd(wdcmd+3,2048);
-    strcat(wdcmd," ; ");
-    strcat(wdcmd,t->cmd);
 
     job[0] = (char *)"/bin/sh";
     job[1] = (char *)"-c";
     job[2] = wdcmd;
+    job[3] = NULL;
+    if (n->bindexe != NULL) {
+        job[2] = node_mgr_bind(n,t,i,num);
+        job[3] = wdcmd;
+        if (job[2] == NULL) {
+            free((void *)wdcmd);
+            return TM_ERROR_NODE;
+        }
+    }
 
-    for (i = 0; i < n->nall; ++i)
-        if (n->node[i].status == NODE_IDLE)
-            break;
-
+    bucket_take(&(n->host[n->node[i].host].launch));
     id = n->nodeid[i];
     t->nodeid = id;
     n->nrun++;
+    n->nidle -= num;
+    n->host[n->node[i].host].nidle -= num;
+    for (j = i + 1; j < i + num; ++j) {
+        n->node[j].status = NODE_HELD;
+        n->node[j].task = t;
+        n->node[j].event = TM_NULL_EVENT;
+    }
     n->node[i].status = NODE_EXEC;
+    n->node[i].ncores = num;
     n->node[i].task = t;
-    rv = tm_spawn(3,job,environ,id,&(t->taskid),&(n->node[i].event));
+    n->node[i].start = wall_time();
+    rv = tm_spawn((job[3] != NULL) ? 4 : 3,job,environ,id,&(t->taskid),
+                  &(n->node[i].event));
+    if (job[2] != wdcmd) free((void *)job[2]);
     free((void *)wdcmd);
 
 #ifdef USE_SYSLOG
@@ -119,13 +774,17 @@ tm_node_id node_mgr_run(node_mgr_t *n, task_t *t)
 
 /* ---------------------------------------- */
 
-int node_mgr_schedule(node_mgr_t *n)
+int node_mgr_schedule(node_mgr_t *n, task_mgr_t *tl, int wait)
 {
-    int i,rv,event;
+    int i,j,rv,event;
+    task_t *t;
+    host_t *h;
+    double runtime;
 
-    if (n == NULL) return 0;
+    /* nothing to wait for */
+    if ((n == NULL) || ((n->nrun == 0) && (n->nstage == 0))) return 0;
 
-    rv = tm_poll(TM_NULL_EVENT,&event,1,&i);
+    rv = tm_poll(TM_NULL_EVENT,&event,wait,&i);
 
     if (rv != TM_SUCCESS) return 0;
     if (event == TM_NULL_EVENT) return 0;
@@ -134,24 +793,59 @@ int node_mgr_schedule(node_mgr_t *n)
     for (i = 0; i < n->nall; ++i) {
 
         if (n->node[i].event == event) {
-            task_t *t = n->node[i].task;
+            t = n->node[i].task;
 
             switch (n->node[i].status) {
 
             case NODE_EXEC:     /* tm_spawn completed. */
                 n->node[i].status = NODE_BUSY;
+                n->tspawn += wall_time() - n->node[i].start;
+                n->nspawn++;
                 tm_obit(t->taskid,&(t->exitval),&(n->node[i].event));
                 break;
 
             case NODE_BUSY:     /* task completed */
-                n->node[i].status = NODE_IDLE;
+                h = n->host + n->node[i].host;
+                for (j = i; j < i + n->node[i].ncores; ++j)
+                    n->node[j].status = NODE_IDLE;
                 n->nrun--;
+                h->nidle += n->node[i].ncores;
+                if (!h->quarantine) n->nidle += n->node[i].ncores;
 #ifdef USE_SYSLOG
                 syslog(LOG_INFO,"{\"job_id\": %s, \"event\": \"task_done\","
-                       "\"task_id\": %d, \"slot_id\": %d}",
-                       pbsjobid,t->tasknum,t->nodeid);
+                       "\"task_id\": %d, \"slot_id\": %d, "
+                       "\"exit_code\": %d, \"attempt\": %d}",
+                       pbsjobid,t->tasknum,t->nodeid,t->exitval,t->ntry+1);
 #endif
-                task_done(t);
+                task_done(tl,t);
+
+                /* collect statistics to detect broken hosts */
+                runtime = wall_time() - n->node[i].start;
+                h->ndone++;
+                h->rdone = QUARANTINE_DECAY*h->rdone + 1.0;
+                h->rfail *= QUARANTINE_DECAY;
+                h->rtime = QUARANTINE_DECAY*h->rtime + runtime;
+                if (t->exitval == 0) {
+                    h->nstreak = 0;
+                    h->tstreak = 0.0;
+                } else {
+                    h->nfail++;
+                    h->rfail += 1.0;
+                    h->nstreak++;
+                    h->tstreak += runtime;
+                    if (h->quarantine) {
+                        if (t->status == TASK_FAILED)
+                            queue_mgr_requeue(n->queue,tl,t->tasknum);
+                    } else if (node_mgr_check_host(n,n->node[i].host)) {
+                        /* give all tasks that failed on it another chance */
+                        for (j = 0; j < task_mgr_nall(tl); ++j) {
+                            const task_t *f = tl->task + j;
+                            if ((f->status == TASK_FAILED)
+                                && (node_mgr_host(n,f->nodeid) == h))
+                                queue_mgr_requeue(n->queue,tl,j);
+                        }
+                    }
+                }
                 break;
 
             default:
@@ -161,6 +855,47 @@ int node_mgr_schedule(node_mgr_t *n)
             return 1;
         }
     }
+
+    /* look for copy operation matching the reported event */
+    for (i = 0; i < n->maxstage; ++i) {
+        stage_t *s = n->stage + i;
+
+        if ((s->status == NODE_IDLE) || (s->event != event)) continue;
+        if (s->status == NODE_EXEC) {
+            s->status = NODE_BUSY;
+            tm_obit(s->taskid,&(s->exitval),&(s->event));
+            return 1;
+        }
+
+        s->status = NODE_IDLE;
+        n->nstage--;
+        t = s->task;
+        if (t == NULL) return 1;
+#ifdef USE_SYSLOG
+        syslog(LOG_INFO,"{\"job_id\": %s, \"event\": \"stage_done\","
+               "\"task_id\": %d, \"host\": \"%s\", \"exit_code\": %d}",
+               pbsjobid,t->tasknum,n->host[s->host].name,s->exitval);
+#endif
+        /* the task may have been launched in the meantime, then the
+           copy is not needed anymore, unless it was staged again */
+        if ((t->stage != STAGE_COPY) || (t->stagehost != s->host)
+            || (t->ntry != s->ntry)) {
+            if (((t->stage != STAGE_COPY) && (t->stage != STAGE_READY))
+                || (t->stagehost != s->host))
+                node_mgr_discard(n,s->host,t->tasknum);
+            return 1;
+        }
+        if (s->exitval == 0) {
+            t->stage = STAGE_READY;
+        } else {
+            printf("Staging input files of task %d to host %s failed\n",
+                   t->tasknum,n->host[s->host].name);
+            t->stage = STAGE_NONE;
+            n->host[s->host].nstaged--;
+            node_mgr_discard(n,s->host,t->tasknum);
+        }
+        return 1;
+    }
     return 0;
 }
 
@@ -177,7 +912,47 @@ int node_mgr_nall(node_mgr_t *n)
 int node_mgr_nidle(node_mgr_t *n)
 {
     if (n == NULL) return 0;
-    return (n->nall - n->nrun);
+    return n->nidle;
+}
+
+/* ---------------------------------------- */
+
+int node_mgr_nready(node_mgr_t *n)
+{
+    int i,num;
+    const host_t *h;
+
+    if (n == NULL) return 0;
+    if (!n->limit) return n->nidle;
+
+    num = 0;
+    for (i = 0; i < n->nhost; ++i) {
+        h = n->host + i;
+        if (h->quarantine || (h->nidle == 0)) continue;
+        if (bucket_ready(&(n->host[i].launch))) num += h->nidle;
+    }
+    return num;
+}
+
+/* ---------------------------------------- */
+
+double node_mgr_latency(node_mgr_t *n)
+{
+    double latency;
+
+    if ((n == NULL) || (n->nspawn == 0)) return 0.0;
+    latency = n->tspawn / (double)n->nspawn;
+    n->tspawn = 0.0;
+    n->nspawn = 0;
+    return latency;
+}
+
+/* ---------------------------------------- */
+
+int node_mgr_nrun(node_mgr_t *n)
+{
+    if (n == NULL) return 0;
+    return n->nrun;
 }
 
 /* ---------------------------------------- */
@@ -197,6 +972,11 @@ void node_mgr_print(node_mgr_t *n)
                    status[n->node[i].status],n->node[i].task->cmd);
         }
     }
+    for (i = 0; i < n->nhost; ++i) {
+        printf("Host %s: %d slots, %d tasks, %d failed%s\n",
+               n->host[i].name,n->host[i].nslots,n->host[i].ndone,
+               n->host[i].nfail,n->host[i].quarantine ? " (quarantined)" : "");
+    }
 }
 
 /*
@@ -12,17 +12,64 @@
 
 #include "torque.h"
 #include "task-mgr.h"
+#include "bucket.h"
+#include "queue-mgr.h"
+
+typedef struct {
+    char *name;         /* host name from node file */
+    int nslots;         /* number of slots on host */
+    int nidle;          /* number of idle slots on host */
+    int ndone;          /* number of tasks finished on host */
+    int nfail;          /* number of tasks failed on host */
+    int nstreak;        /* number of consecutive failed tasks on host */
+    double tstreak;     /* accumulated runtime of consecutive failures */
+    double rdone;       /* decayed number of recently finished tasks */
+    double rfail;       /* decayed number of recently failed tasks */
+    double rtime;       /* decayed runtime of recently finished tasks */
+    int quarantine;     /* nonzero if host receives no more tasks */
+    int nstaged;        /* number of queued tasks staged on host */
+    int slot;           /* index of first slot on host */
+    bucket_t launch;    /* limits the rate of task launches on host */
+} host_t;
 
 typedef struct {
     task_t *task;
     int status;
+    int host;           /* index of physical host of this slot */
+    int local;          /* index of this slot among the slots of its host */
+    int ncores;         /* number of adjacent slots used by current task */
+    double start;       /* time when current task was launched */
     tm_event_t event;
 } node_t;
 
+typedef struct {
+    task_t *task;       /* task whose input files are copied */
+    int ntry;           /* attempt of task the copy was made for */
+    int host;           /* index of host the files are copied to */
+    int status;
+    int exitval;
+    tm_task_id taskid;
+    tm_event_t event;
+} stage_t;
+
 typedef struct {
     int nall;
     int nrun;
+    int nidle;          /* idle slots on hosts not in quarantine */
+    int nhost;
+    int limit;          /* nonzero if task launches per host are limited */
+    int nspawn;         /* number of spawns completed since last query */
+    double tspawn;      /* accumulated latency of those spawns */
+    int bindlog;        /* nonzero if CPU binding is logged */
+    char *bindexe;      /* program that binds tasks on each host or NULL */
+    int depth;          /* number of tasks to stage per host */
+    int nstage;         /* number of copy operations in progress */
+    int maxstage;       /* maximum number of copy operations */
+    char *stagedir;     /* directory for staged files on each host */
+    queue_mgr_t *queue; /* shared task list or NULL */
+    stage_t *stage;
     node_t *node;
+    host_t *host;
     struct tm_roots roots;
     tm_node_id *nodeid;
 } node_mgr_t;
@@ -38,7 +85,57 @@ node_mgr_t *node_mgr_init();
  */
 void node_mgr_exit(node_mgr_t *n);
 
-/*! Launch a task on an idle node
+/*! Bind tasks to CPU cores. Each slot gets an equal share of the
+ * cores of its host, taken in NUMA node order. Since the cpuset of
+ * the job may differ between hosts, the CPUs are determined on each
+ * host by running this program there in binding mode, which then
+ * executes the task.
+ * \param n node list struct allocated by node_mgr_init
+ * \param report if nonzero, log the CPUs of each task on its host
+ * \return 0 if successful, other on failure
+ */
+int node_mgr_binding(node_mgr_t *n, int report);
+
+/*! Use a shared task list. Tasks queued again after their host was
+ * put into quarantine are claimed again through it.
+ * \param n node list struct allocated by node_mgr_init
+ * \param q queue struct allocated by queue_mgr_init
+ */
+void node_mgr_sharing(node_mgr_t *n, queue_mgr_t *q);
+
+/*! Limit the rate of task launches on each host
+ * \param n node list struct allocated by node_mgr_init
+ * \param rate maximum launches per second and host, 0 for unlimited
+ */
+void node_mgr_limit(node_mgr_t *n, double rate);
+
+/*! Enable staging of task input files to node-local scratch
+ * \param n node list struct allocated by node_mgr_init
+ * \param scratch node-local scratch directory
+ * \param depth number of queued tasks to stage on each host
+ * \return 0 if successful, other on failure
+ */
+int node_mgr_staging(node_mgr_t *n, const char *scratch, int depth);
+
+/*! Start copying input files of upcoming tasks to hosts
+ * \param n node list struct allocated by node_mgr_init
+ * \param t task list struct allocated by task_mgr_init
+ */
+void node_mgr_prefetch(node_mgr_t *n, task_mgr_t *t);
+
+/*! Pick the next task to launch. With staging, a task whose input
+ * files are ready on a host with an idle slot comes first, then a
+ * task that is not staged on a busy host, otherwise the next task.
+ * \param n node list struct allocated by node_mgr_init
+ * \param t task list struct allocated by task_mgr_init
+ * \return task or NULL if no task is ready
+ */
+task_t *node_mgr_next(node_mgr_t *n, task_mgr_t *t);
+
+/*! Launch a task on an idle node.
+ * A task with staged input files is preferably sent to the host
+ * holding them, a task that failed before to a different host.
+ * Hosts that reached their launch rate limit are skipped.
  * \param n node list struct allocated by node_mgr_init
  * \param t task struct to execute
  * \return allocated node id if successful, otherwise TM_ERROR_NODE
@@ -57,11 +154,35 @@ int node_mgr_nall(node_mgr_t *n);
  */
 int node_mgr_nidle(node_mgr_t *n);
 
-/*! Process pending Torque events
+/*! Return number of idle nodes a task may be launched on right now,
+ * i.e. on hosts that have not reached their launch rate limit
  * \param t node list struct allocated by node_mgr_init
+ * \return number of nodes
+ */
+int node_mgr_nready(node_mgr_t *n);
+
+/*! Return average time from launching a task to its spawn being
+ * confirmed, for the spawns completed since the previous call
+ * \param t node list struct allocated by node_mgr_init
+ * \return latency in seconds or 0 if no spawn completed
+ */
+double node_mgr_latency(node_mgr_t *n);
+
+/*! Return number of nodes with a task in progress
+ * \param t node list struct allocated by node_mgr_init
+ * \return number of nodes
+ */
+int node_mgr_nrun(node_mgr_t *n);
+
+/*! Process pending Torque events.
+ * Hosts where tasks fail much faster than on the other hosts
+ * are put into quarantine and their failed tasks are queued again.
+ * \param n node list struct allocated by node_mgr_init
+ * \param t task list struct allocated by task_mgr_init
+ * \param wait if nonzero, block until an event arrives
  * \return 1 if event processed, 0 if no event was pending
  */
-int node_mgr_schedule(node_mgr_t *n);
+int node_mgr_schedule(node_mgr_t *n, task_mgr_t *t, int wait);
 
 /*! Print node list
  * \param t node list struct allocated by node_mgr_init
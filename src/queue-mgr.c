@@ -0,0 +1,459 @@
+
+/*
+ * Torque task list launcher tool.
+ *
+ * Copyright (c) 2015,2017 Axel Kohlmeyer <akohlmey@gmail.com>
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef USE_SYSLOG
+#include <syslog.h>
+#endif
+
+#include "queue-mgr.h"
+
+/** identifier at the beginning of the shared state file */
+#define QUEUE_MAGIC "TLQUEUE1"
+
+/** maximum number of jobs that can share one task list */
+#define QUEUE_MAXOWNER 1024
+
+/** time in seconds between heartbeats and reports of completed tasks */
+#define QUEUE_SYNC_RATE 30
+
+/** time in seconds without heartbeat after which a job is considered dead */
+#define QUEUE_TIMEOUT 600
+
+/* a live job must be able to miss several heartbeats before it is
+   declared dead. this relies on queue_mgr_sync() being called at
+   least every QUEUE_SYNC_RATE seconds, even while all tasks run. */
+#if QUEUE_TIMEOUT < 4*QUEUE_SYNC_RATE
+#error "QUEUE_TIMEOUT must be at least four times QUEUE_SYNC_RATE"
+#endif
+
+/** number of claim records processed at once while reclaiming */
+#define QUEUE_CHUNK 1024
+
+#define OWNER_ACTIVE 1
+#define OWNER_DONE   2
+#define OWNER_DEAD   3
+
+/* The shared state file consists of a header, a table of all jobs that
+ * have registered, one status byte per task, and the list of claimed
+ * task ranges appended at the end. All updates happen while holding
+ * an exclusive fcntl() lock on the whole file. */
+
+typedef struct {
+    char magic[8];
+    int ntasks;
+    int next;           /* first task not yet claimed by any job */
+    int nowner;
+    int nclaim;
+} qheader_t;
+
+typedef struct {
+    char id[56];
+    int state;
+    int pad;
+    long heartbeat;
+} qowner_t;
+
+typedef struct {
+    int first;
+    int num;
+    int owner;
+    int pad;
+} qclaim_t;
+
+#define OWNER_OFFSET  ((off_t)sizeof(qheader_t))
+#define STATUS_OFFSET (OWNER_OFFSET + (off_t)QUEUE_MAXOWNER*sizeof(qowner_t))
+
+/* ---------------------------------------- */
+
+static off_t claim_offset(int ntasks)
+{
+    return ((STATUS_OFFSET + ntasks + 7) / 8) * 8;
+}
+
+static int queue_lock(int fd, short type)
+{
+    struct flock fl;
+
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 0;
+    fl.l_len = 0;
+    return fcntl(fd,F_SETLKW,&fl);
+}
+
+static int queue_read(int fd, void *buf, size_t len, off_t pos)
+{
+    return (pread(fd,buf,len,pos) == (ssize_t)len) ? 0 : 1;
+}
+
+static int queue_write(int fd, const void *buf, size_t len, off_t pos)
+{
+    return (pwrite(fd,buf,len,pos) == (ssize_t)len) ? 0 : 1;
+}
+
+static queue_mgr_t *queue_fail(queue_mgr_t *q, const char *msg)
+{
+    printf("%s\n",msg);
+    if (q->fd >= 0) {
+        queue_lock(q->fd,F_UNLCK);
+        close(q->fd);
+    }
+    free((void *)q->mine);
+    free((void *)q);
+    return NULL;
+}
+
+/* add task to the pending queue and remember it as claimed by us */
+static void queue_take(queue_mgr_t *q, task_mgr_t *t, int num)
+{
+    if (task_mgr_queue(t,num) == 0)
+        q->mine[q->nmine++] = num;
+}
+
+/* write status of finished tasks and update our owner record.
+   must be called while holding the lock. */
+static void queue_report(queue_mgr_t *q, task_mgr_t *t, int final)
+{
+    qowner_t o;
+    off_t pos;
+    int i,j;
+    char s;
+
+    for (i = j = 0; i < q->nmine; ++i) {
+        const task_t *k = &(t->task[q->mine[i]]);
+        if ((k->status == TASK_COMPLETE) || (k->status == TASK_FAILED)) {
+            s = (char)k->status;
+            queue_write(q->fd,&s,1,STATUS_OFFSET + q->mine[i]);
+        } else q->mine[j++] = q->mine[i];
+    }
+    q->nmine = j;
+
+    q->lastsync = time(NULL);
+    pos = OWNER_OFFSET + (off_t)q->owner*sizeof(qowner_t);
+    if (queue_read(q->fd,&o,sizeof(o),pos) == 0) {
+        /* another job took over our claims. do not come back to life,
+           or our tasks may be handed over a second time. */
+        if (o.state == OWNER_DEAD) {
+            if (final || (q->nmine > 0))
+                printf("Warning: this job was declared dead and its "
+                       "unfinished tasks were taken over by another job.\n");
+            return;
+        }
+        o.state = OWNER_ACTIVE;
+        o.heartbeat = q->lastsync;
+        if (final) {
+            /* unfinished claims are up for grabs right away */
+            if (q->nmine > 0) o.heartbeat = 0;
+            else o.state = OWNER_DONE;
+        }
+        queue_write(q->fd,&o,sizeof(o),pos);
+    }
+}
+
+/* transfer claims of a dead job to us and queue its unfinished tasks.
+   must be called while holding the lock. */
+static int queue_reclaim(queue_mgr_t *q, task_mgr_t *t,
+                         const qheader_t *h, int dead)
+{
+    qclaim_t c[QUEUE_CHUNK];
+    char *s;
+    off_t pos;
+    int i,j,k,num,nread;
+
+    num = 0;
+    s = (char *)malloc(h->ntasks > 0 ? h->ntasks : 1);
+    if (s == NULL) return 0;
+    if (queue_read(q->fd,s,h->ntasks,STATUS_OFFSET) != 0) {
+        free((void *)s);
+        return 0;
+    }
+
+    pos = claim_offset(h->ntasks);
+    for (i = 0; i < h->nclaim; i += QUEUE_CHUNK) {
+        nread = h->nclaim - i;
+        if (nread > QUEUE_CHUNK) nread = QUEUE_CHUNK;
+        if (queue_read(q->fd,c,nread*sizeof(qclaim_t),
+                       pos + (off_t)i*sizeof(qclaim_t)) != 0) break;
+
+        for (j = 0; j < nread; ++j) {
+            if (c[j].owner != dead) continue;
+            c[j].owner = q->owner;
+            for (k = c[j].first; k < c[j].first + c[j].num; ++k) {
+                if ((k < t->nall) && (s[k] == 0)) {
+                    queue_take(q,t,k);
+                    ++num;
+                }
+            }
+        }
+        queue_write(q->fd,c,nread*sizeof(qclaim_t),
+                    pos + (off_t)i*sizeof(qclaim_t));
+    }
+    free((void *)s);
+    return num;
+}
+
+/* count unfinished tasks claimed by other jobs that are still alive.
+   must be called while holding the lock. */
+static int queue_count_others(queue_mgr_t *q, const qheader_t *h)
+{
+    qclaim_t c[QUEUE_CHUNK];
+    qowner_t o;
+    char *s,*alive;
+    off_t pos;
+    int i,j,k,nread,num;
+
+    num = 0;
+    s = (char *)malloc(h->ntasks > 0 ? h->ntasks : 1);
+    alive = (char *)calloc(QUEUE_MAXOWNER,1);
+    if ((s == NULL) || (alive == NULL)
+        || (queue_read(q->fd,s,h->ntasks,STATUS_OFFSET) != 0)) {
+        free((void *)s);
+        free((void *)alive);
+        return 0;
+    }
+    for (i = 0; (i < h->nowner) && (i < QUEUE_MAXOWNER); ++i) {
+        pos = OWNER_OFFSET + (off_t)i*sizeof(qowner_t);
+        if ((i != q->owner) && (queue_read(q->fd,&o,sizeof(o),pos) == 0))
+            alive[i] = (o.state == OWNER_ACTIVE);
+    }
+
+    pos = claim_offset(h->ntasks);
+    for (i = 0; i < h->nclaim; i += QUEUE_CHUNK) {
+        nread = h->nclaim - i;
+        if (nread > QUEUE_CHUNK) nread = QUEUE_CHUNK;
+        if (queue_read(q->fd,c,nread*sizeof(qclaim_t),
+                       pos + (off_t)i*sizeof(qclaim_t)) != 0) break;
+        for (j = 0; j < nread; ++j) {
+            if ((c[j].owner < 0) || (c[j].owner >= QUEUE_MAXOWNER)
+                || !alive[c[j].owner]) continue;
+            for (k = c[j].first; k < c[j].first + c[j].num; ++k)
+                if ((k < h->ntasks) && (s[k] == 0)) ++num;
+        }
+    }
+    free((void *)s);
+    free((void *)alive);
+    return num;
+}
+
+/* ---------------------------------------- */
+
+queue_mgr_t *queue_mgr_init(const char *name, int ntasks, int batch)
+{
+    qheader_t h;
+    qowner_t o;
+    struct stat st;
+    const char *id;
+    queue_mgr_t *q;
+
+    if ((name == NULL) || (ntasks < 0)) return NULL;
+    q = (queue_mgr_t *)malloc(sizeof(queue_mgr_t));
+    if (q == NULL) return NULL;
+
+    q->ntasks = ntasks;
+    q->batch = (batch > 0) ? batch : 1;
+    q->nmine = 0;
+    q->lastsync = 0;
+    q->lastempty = 0;
+    q->nothers = 0;
+    q->mine = (int *)malloc((ntasks > 0 ? ntasks : 1)*sizeof(int));
+    q->fd = -1;
+    if (q->mine == NULL)
+        return queue_fail(q,"Error allocating shared queue data.");
+
+    q->fd = open(name,O_RDWR|O_CREAT,0644);
+    if (q->fd < 0) {
+        perror("Error opening shared state file");
+        return queue_fail(q,"Cannot share task list.");
+    }
+    if (queue_lock(q->fd,F_WRLCK) != 0) {
+        perror("Error locking shared state file");
+        close(q->fd);
+        q->fd = -1;
+        return queue_fail(q,"Cannot share task list.");
+    }
+
+    /* first job creates the file, all others must agree with it */
+    if (fstat(q->fd,&st) != 0)
+        return queue_fail(q,"Error accessing shared state file.");
+    if (st.st_size == 0) {
+        memset(&h,0,sizeof(h));
+        memcpy(h.magic,QUEUE_MAGIC,sizeof(h.magic));
+        h.ntasks = ntasks;
+        if ((queue_write(q->fd,&h,sizeof(h),0) != 0)
+            || (ftruncate(q->fd,claim_offset(ntasks)) != 0))
+            return queue_fail(q,"Error initializing shared state file.");
+    } else {
+        if ((queue_read(q->fd,&h,sizeof(h),0) != 0)
+            || (memcmp(h.magic,QUEUE_MAGIC,sizeof(h.magic)) != 0))
+            return queue_fail(q,"Shared state file has unknown format.");
+        if (h.ntasks != ntasks)
+            return queue_fail(q,"Shared state file does not match task list.");
+    }
+    if (h.nowner >= QUEUE_MAXOWNER)
+        return queue_fail(q,"Too many jobs sharing the task list.");
+
+    /* register this job */
+    memset(&o,0,sizeof(o));
+    id = getenv("PBS_JOBID");
+    if (id != NULL)
+        snprintf(o.id,sizeof(o.id),"%s",id);
+    else
+        snprintf(o.id,sizeof(o.id),"pid %d",(int)getpid());
+    o.state = OWNER_ACTIVE;
+    o.heartbeat = time(NULL);
+    q->owner = h.nowner;
+    h.nowner++;
+    if ((queue_write(q->fd,&o,sizeof(o),OWNER_OFFSET
+                     + (off_t)q->owner*sizeof(qowner_t)) != 0)
+        || (queue_write(q->fd,&h,sizeof(h),0) != 0))
+        return queue_fail(q,"Error registering with shared state file.");
+
+    queue_lock(q->fd,F_UNLCK);
+    q->lastsync = o.heartbeat;
+    return q;
+}
+
+/* ---------------------------------------- */
+
+void queue_mgr_exit(queue_mgr_t *q, task_mgr_t *t)
+{
+    if (q == NULL) return;
+    if ((t != NULL) && (queue_lock(q->fd,F_WRLCK) == 0)) {
+        queue_report(q,t,1);
+        queue_lock(q->fd,F_UNLCK);
+    }
+    close(q->fd);
+    free((void *)q->mine);
+    free((void *)q);
+}
+
+/* ---------------------------------------- */
+
+int queue_mgr_claim(queue_mgr_t *q, task_mgr_t *t)
+{
+    qheader_t h;
+    qowner_t o;
+    qclaim_t c;
+    off_t pos;
+    time_t now;
+    int i,j,num;
+
+    if ((q == NULL) || (t == NULL)) return 0;
+
+    /* do not hammer the state file once the task list is exhausted */
+    now = time(NULL);
+    if ((now - q->lastempty) < QUEUE_SYNC_RATE) return 0;
+
+    if (queue_lock(q->fd,F_WRLCK) != 0) return 0;
+    queue_report(q,t,0);
+
+    /* waiting for the lock may have taken a while */
+    now = time(NULL);
+    num = 0;
+    if (queue_read(q->fd,&h,sizeof(h),0) == 0) {
+
+        /* hand over claims of jobs that stopped sending heartbeats */
+        for (i = 0; i < h.nowner; ++i) {
+            if (i == q->owner) continue;
+            pos = OWNER_OFFSET + (off_t)i*sizeof(qowner_t);
+            if (queue_read(q->fd,&o,sizeof(o),pos) != 0) continue;
+            if (o.state != OWNER_ACTIVE) continue;
+            /* a heartbeat of 0 means the job exited with unfinished claims.
+               otherwise it must be older than the timeout. */
+            if ((o.heartbeat != 0) && ((now - o.heartbeat) < QUEUE_TIMEOUT))
+                continue;
+
+            j = queue_reclaim(q,t,&h,i);
+            o.state = OWNER_DEAD;
+            queue_write(q->fd,&o,sizeof(o),pos);
+            printf("Took over %d unfinished tasks from job %s.\n",j,o.id);
+#ifdef USE_SYSLOG
+            syslog(LOG_INFO,"{\"job_id\": %s, \"event\": \"reclaim\","
+                   "\"dead_job_id\": %s, \"num_tasks\": %d}",
+                   pbsjobid,o.id,j);
+#endif
+            num += j;
+        }
+
+        /* claim a new batch of tasks */
+        if ((num == 0) && (h.next < h.ntasks)) {
+            c.first = h.next;
+            c.num = h.ntasks - h.next;
+            if (c.num > q->batch) c.num = q->batch;
+            c.owner = q->owner;
+            c.pad = 0;
+            pos = claim_offset(h.ntasks) + (off_t)h.nclaim*sizeof(qclaim_t);
+            if (queue_write(q->fd,&c,sizeof(c),pos) == 0) {
+                h.nclaim++;
+                h.next += c.num;
+                if (queue_write(q->fd,&h,sizeof(h),0) == 0) {
+                    for (j = c.first; j < c.first + c.num; ++j)
+                        queue_take(q,t,j);
+                    num = c.num;
+                }
+            }
+        }
+
+        /* nothing left to claim, but other jobs may still die */
+        q->nothers = (num == 0) ? queue_count_others(q,&h) : 0;
+    }
+    queue_lock(q->fd,F_UNLCK);
+
+    if (num == 0) q->lastempty = now;
+    return num;
+}
+
+/* ---------------------------------------- */
+
+void queue_mgr_sync(queue_mgr_t *q, task_mgr_t *t)
+{
+    if ((q == NULL) || (t == NULL)) return;
+    if ((time(NULL) - q->lastsync) < QUEUE_SYNC_RATE) return;
+
+    if (queue_lock(q->fd,F_WRLCK) != 0) return;
+    queue_report(q,t,0);
+    queue_lock(q->fd,F_UNLCK);
+}
+
+/* ---------------------------------------- */
+
+int queue_mgr_others(queue_mgr_t *q)
+{
+    if (q == NULL) return 0;
+    return q->nothers;
+}
+
+/* ---------------------------------------- */
+
+int queue_mgr_requeue(queue_mgr_t *q, task_mgr_t *t, int num)
+{
+    int i;
+
+    if (q == NULL) return task_mgr_queue(t,num);
+    if (task_mgr_queue(t,num) != 0) return 1;
+
+    /* the task may not have been reported yet */
+    for (i = 0; i < q->nmine; ++i)
+        if (q->mine[i] == num) return 0;
+    q->mine[q->nmine++] = num;
+    return 0;
+}
+
+/*
+ * Local Variables:
+ * c-basic-offset: 4
+ * auto-revert-buffer: 't
+ * compile-command: "make -k -C ../ fedora"
+ * End:
+ */
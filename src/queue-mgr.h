@@ -0,0 +1,85 @@
+
+/*
+ * Torque task list launcher tool.
+ *
+ * Copyright (c) 2015,2017 Axel Kohlmeyer <akohlmey@gmail.com>
+ */
+
+/* API for sharing a task list between multiple torque-launch jobs */
+
+#ifndef TL_QUEUE_MGR_H
+#define TL_QUEUE_MGR_H
+
+#include <time.h>
+
+#include "task-mgr.h"
+
+typedef struct {
+    int fd;             /* file descriptor of shared state file */
+    int ntasks;         /* number of tasks in shared task list */
+    int batch;          /* number of tasks to claim at once */
+    int owner;          /* index of this job in the owner table */
+    int nmine;          /* number of claimed and unreported tasks */
+    int *mine;          /* list of claimed and unreported tasks */
+    time_t lastsync;    /* time of last sync with the state file */
+    time_t lastempty;   /* time of last claim that returned no tasks */
+    int nothers;        /* unfinished tasks claimed by other live jobs */
+} queue_mgr_t;
+
+/*! Open (or create) shared state file and register this job
+ * \param name name of the shared state file
+ * \param ntasks number of tasks in task list
+ * \param batch number of tasks to claim at once
+ * \return allocated queue struct or NULL on failure
+ */
+queue_mgr_t *queue_mgr_init(const char *name, int ntasks, int batch);
+
+/*! Report outstanding completions, unregister job and free queue struct
+ * \param q queue struct allocated by queue_mgr_init
+ * \param t task list struct allocated by task_mgr_init
+ */
+void queue_mgr_exit(queue_mgr_t *q, task_mgr_t *t);
+
+/*! Claim a batch of tasks and add them to the pending task queue.
+ * Claims of jobs that have stopped updating the state file are
+ * handed over before new tasks are claimed.
+ * \param q queue struct allocated by queue_mgr_init
+ * \param t task list struct allocated by task_mgr_init
+ * \return number of tasks claimed
+ */
+int queue_mgr_claim(queue_mgr_t *q, task_mgr_t *t);
+
+/*! Write completed tasks to the shared state file and update heartbeat.
+ * This is rate limited, so it can be called from the scheduling loop.
+ * \param q queue struct allocated by queue_mgr_init
+ * \param t task list struct allocated by task_mgr_init
+ */
+void queue_mgr_sync(queue_mgr_t *q, task_mgr_t *t);
+
+/*! Check whether other jobs still hold unfinished claims. Those may
+ * be taken over if the jobs die, so a job should not exit while this
+ * is nonzero. Updated by queue_mgr_claim() when nothing is left.
+ * \param q queue struct allocated by queue_mgr_init or NULL
+ * \return number of unfinished tasks claimed by other live jobs
+ */
+int queue_mgr_others(queue_mgr_t *q);
+
+/*! Queue a task again that was already finished, e.g. because it
+ * failed on a broken host. The task is claimed by this job again, so
+ * that its new result is written to the shared state file.
+ * \param q queue struct allocated by queue_mgr_init or NULL
+ * \param t task list struct allocated by task_mgr_init
+ * \param num index of task
+ * \return 0 if successful, other on failure
+ */
+int queue_mgr_requeue(queue_mgr_t *q, task_mgr_t *t, int num);
+
+#endif
+
+/*
+ * Local Variables:
+ * c-basic-offset: 4
+ * auto-revert-buffer: 't
+ * compile-command: "make -k -C ../ fedora"
+ * End:
+ */
@@ -0,0 +1,424 @@
+
+/*
+ * Torque task list launcher tool.
+ *
+ * Copyright (c) 2015,2017 Axel Kohlmeyer <akohlmey@gmail.com>
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "simulate.h"
+#include "stream.h"
+
+/** maximum length of line in runtime history file */
+#define LINEBUFSZ 2048
+
+/** maximum length of runtime annotation */
+#define VALUESZ 64
+
+/* runtime history entry. commands are only stored as hash value */
+typedef struct {
+    unsigned long long key;
+    double sum;
+    int num;
+} hist_t;
+
+typedef struct {
+    int size;           /* number of entries, always a power of 2 */
+    int used;
+    hist_t *entry;
+} hist_table_t;
+
+/* ---------------------------------------- */
+
+/* FNV-1a hash of a command, ignoring trailing whitespace. never 0. */
+static unsigned long long sim_hash(const char *cmd)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    int i,len;
+
+    len = strlen(cmd);
+    while ((len > 0) && isspace(cmd[len-1])) --len;
+    for (i = 0; i < len; ++i) {
+        hash ^= (unsigned char)cmd[i];
+        hash *= 1099511628211ULL;
+    }
+    return (hash == 0) ? 1 : hash;
+}
+
+/* ---------------------------------------- */
+
+static hist_t *hist_find(hist_table_t *h, unsigned long long key)
+{
+    int i = (int)(key & (unsigned long long)(h->size - 1));
+    while ((h->entry[i].key != 0) && (h->entry[i].key != key))
+        i = (i + 1) & (h->size - 1);
+    return h->entry + i;
+}
+
+/* ---------------------------------------- */
+
+static int hist_add(hist_table_t *h, unsigned long long key, double runtime)
+{
+    hist_t *e,*old;
+    int i,size;
+
+    /* keep table at most half full */
+    if (2*(h->used+1) > h->size) {
+        old = h->entry;
+        size = h->size;
+        h->size = (size > 0) ? 2*size : 1024;
+        h->entry = (hist_t *)calloc(h->size,sizeof(hist_t));
+        if (h->entry == NULL) {
+            h->entry = old;
+            h->size = size;
+            return 1;
+        }
+        for (i = 0; i < size; ++i)
+            if (old[i].key != 0) *hist_find(h,old[i].key) = old[i];
+        free((void *)old);
+    }
+
+    e = hist_find(h,key);
+    if (e->key == 0) {
+        e->key = key;
+        h->used++;
+    }
+    e->sum += runtime;
+    e->num++;
+    return 0;
+}
+
+/* ---------------------------------------- */
+
+static int hist_load(hist_table_t *h, const char *name)
+{
+    stream_t *fp;
+    char linebuf[LINEBUFSZ];
+    char *ptr,*end;
+    double runtime;
+    int nlines;
+
+    fp = stream_open(name);
+    if (fp == NULL) {
+        perror("Error opening runtime history file");
+        return 1;
+    }
+
+    nlines = 0;
+    while ((ptr = stream_gets(linebuf,LINEBUFSZ,fp)) != NULL) {
+        ++nlines;
+        while (isspace(*ptr)) ++ptr;
+        if ((*ptr == '\0') || (*ptr == '#')) continue;
+        runtime = strtod(ptr,&end);
+        if ((end == ptr) || (runtime < 0.0)) {
+            printf("Invalid runtime in line %d of history file '%s'.\n",
+                   nlines,name);
+            continue;
+        }
+        ptr = end;
+        while (isspace(*ptr)) ++ptr;
+        if (hist_add(h,sim_hash(ptr),runtime) != 0) {
+            stream_close(fp);
+            return 2;
+        }
+    }
+    if (stream_error(fp)) {
+        printf("Error reading history file '%s' after line %d.\n",
+               name,nlines);
+        stream_close(fp);
+        return 3;
+    }
+    stream_close(fp);
+    return 0;
+}
+
+/* ---------------------------------------- */
+
+/* format time as h:mm:ss like a walltime request, rounding up */
+static char *sim_time(double t, char *buf)
+{
+    long sec = (long)t;
+    if ((double)sec < t) ++sec;
+    sprintf(buf,"%ld:%02ld:%02ld",sec/3600,(sec/60)%60,sec%60);
+    return buf;
+}
+
+/* ---------------------------------------- */
+
+static void sim_sift(double *heap, int num)
+{
+    double top = heap[0];
+    int i,j;
+
+    i = 0;
+    while ((j = 2*i+1) < num) {
+        if ((j+1 < num) && (heap[j+1] < heap[j])) ++j;
+        if (top <= heap[j]) break;
+        heap[i] = heap[j];
+        i = j;
+    }
+    heap[i] = top;
+}
+
+/* ---------------------------------------- */
+
+sim_t *sim_init(task_mgr_t *t, const char *history, double runtime,
+                double rate)
+{
+    sim_t *s;
+    task_t *k;
+    hist_table_t h;
+    hist_t *e;
+    char value[VALUESZ];
+    double sum;
+    int i,num;
+
+    if (t == NULL) return NULL;
+
+    h.size = h.used = 0;
+    h.entry = NULL;
+    if ((history != NULL) && (hist_load(&h,history) != 0)) {
+        free((void *)h.entry);
+        return NULL;
+    }
+
+    num = task_mgr_todo(t);
+    s = (sim_t *)calloc(1,sizeof(sim_t));
+    if (s != NULL) {
+        s->runtime = (double *)malloc((num > 0 ? num : 1)*sizeof(double));
+        s->start = (double *)malloc((num > 0 ? num : 1)*sizeof(double));
+    }
+    if ((s == NULL) || (s->runtime == NULL) || (s->start == NULL)) {
+        sim_exit(s);
+        free((void *)h.entry);
+        return NULL;
+    }
+
+    /* tasks without estimate are marked with a negative runtime */
+    sum = 0.0;
+    s->rate = rate;
+    while ((s->ntasks < num) && ((k = task_mgr_next(t)) != NULL)) {
+        double r = -1.0;
+        if (task_annotation(k,"runtime",value,VALUESZ) != NULL) {
+            r = atof(value);
+        } else if (h.used > 0) {
+            e = hist_find(&h,sim_hash(k->cmd));
+            if (e->key != 0) r = e->sum / (double)e->num;
+        }
+        if (r >= 0.0) {
+            s->nknown++;
+            sum += r;
+        }
+        s->runtime[s->ntasks++] = r;
+    }
+    free((void *)h.entry);
+
+    if (runtime > 0.0)
+        s->fallback = runtime;
+    else if (s->nknown > 0)
+        s->fallback = sum / (double)s->nknown;
+    else if (s->ntasks > 0) {
+        printf("No runtime estimates for any task.\n");
+        sim_exit(s);
+        return NULL;
+    }
+    for (i = 0; i < s->ntasks; ++i)
+        if (s->runtime[i] < 0.0) s->runtime[i] = s->fallback;
+
+    return s;
+}
+
+/* ---------------------------------------- */
+
+void sim_exit(sim_t *s)
+{
+    if (s == NULL) return;
+    free((void *)s->runtime);
+    free((void *)s->start);
+    free((void *)s);
+}
+
+/* ---------------------------------------- */
+
+int sim_run(sim_t *s, int nslots, sim_result_t *r)
+{
+    double busy[SIM_NBINS];
+    int full[SIM_NBINS+1];
+    double *heap;
+    double start,end,next,width;
+    int i,b0,b1,num;
+
+    if ((s == NULL) || (r == NULL) || (nslots < 1)) return 1;
+
+    /* more slots than tasks: the surplus slots are never used */
+    num = (nslots < s->ntasks) ? nslots : s->ntasks;
+    heap = (double *)calloc((num > 0) ? num : 1,sizeof(double));
+    if (heap == NULL) return 2;
+
+    memset(r,0,sizeof(sim_result_t));
+    r->nslots = nslots;
+
+    /* launch each task on the slot that becomes idle first,
+       but not faster than the launch rate limit permits */
+    next = 0.0;
+    for (i = 0; i < s->ntasks; ++i) {
+        start = heap[0];
+        if (s->rate > 0.0) {
+            if (start < next) start = next;
+            next = start + 1.0/s->rate;
+        }
+        end = start + s->runtime[i];
+        s->start[i] = start;
+        heap[0] = end;
+        sim_sift(heap,num);
+        r->work += s->runtime[i];
+        if (end > r->makespan) r->makespan = end;
+    }
+
+    /* the slot with the earliest end has no task left to launch */
+    r->tail = r->makespan;
+    if ((num > 0) && (num == nslots)) r->tail -= heap[0];
+    free((void *)heap);
+
+    /* accumulate busy time in intervals of equal width */
+    if (r->makespan <= 0.0) return 0;
+    width = r->makespan / (double)SIM_NBINS;
+    memset(busy,0,sizeof(busy));
+    memset(full,0,sizeof(full));
+    for (i = 0; i < s->ntasks; ++i) {
+        start = s->start[i];
+        end = start + s->runtime[i];
+        b0 = (int)(start / width);
+        b1 = (int)(end / width);
+        if (b0 > SIM_NBINS-1) b0 = SIM_NBINS-1;
+        if (b1 > SIM_NBINS-1) b1 = SIM_NBINS-1;
+        if (b0 == b1) {
+            busy[b0] += end - start;
+        } else {
+            busy[b0] += (b0+1)*width - start;
+            busy[b1] += end - b1*width;
+            full[b0+1]++;
+            full[b1]--;
+        }
+    }
+    num = 0;
+    for (i = 0; i < SIM_NBINS; ++i) {
+        num += full[i];
+        r->util[i] = (busy[i] + num*width) / (nslots*width);
+    }
+    return 0;
+}
+
+/* ---------------------------------------- */
+
+/* parse list of slot counts like "16,32-128:32". returns number of
+   entries or -1 on error. a NULL list only counts the entries. */
+static int sim_slots(const char *slots, int *list)
+{
+    const char *ptr;
+    char *end;
+    int first,last,step,num;
+
+    num = 0;
+    ptr = slots;
+    while (*ptr != '\0') {
+        first = last = strtol(ptr,&end,10);
+        step = 1;
+        if (end == ptr) return -1;
+        if (*end == '-') {
+            ptr = end+1;
+            last = strtol(ptr,&end,10);
+            if (end == ptr) return -1;
+            if (*end == ':') {
+                ptr = end+1;
+                step = strtol(ptr,&end,10);
+                if (end == ptr) return -1;
+            }
+        }
+        if ((first < 1) || (last < first) || (step < 1)) return -1;
+        for (; first <= last; first += step) {
+            if (list != NULL) list[num] = first;
+            ++num;
+        }
+        ptr = end;
+        if (*ptr == ',') ++ptr;
+        else if (*ptr != '\0') return -1;
+    }
+    return num;
+}
+
+/* ---------------------------------------- */
+
+int sim_report(sim_t *s, const char *slots)
+{
+    sim_result_t r;
+    char buf1[32],buf2[32];
+    int *list;
+    int i,j,num;
+
+    if ((s == NULL) || (slots == NULL)) return 1;
+    num = sim_slots(slots,NULL);
+    if (num < 1) {
+        printf("Invalid list of slot counts: %s\n",slots);
+        return 1;
+    }
+    list = (int *)malloc(num*sizeof(int));
+    if (list == NULL) return 2;
+    sim_slots(slots,list);
+
+    printf("Simulating %d tasks, %d with runtime estimate",
+           s->ntasks,s->nknown);
+    if (s->nknown < s->ntasks)
+        printf(", others assumed to take %.1f seconds",s->fallback);
+    printf(".\n");
+    if (s->rate > 0.0)
+        printf("Launching at most %g tasks per second.\n",s->rate);
+
+    if (num > 1)
+        printf("\n  Slots      Makespan  Utilization          Tail\n");
+
+    for (i = 0; i < num; ++i) {
+        if (sim_run(s,list[i],&r) != 0) {
+            printf("Error simulating %d slots.\n",list[i]);
+            free((void *)list);
+            return 3;
+        }
+        if (num > 1) {
+            printf("%7d %13s %11.1f%% %13s\n",r.nslots,
+                   sim_time(r.makespan,buf1),(r.makespan > 0.0) ? 100.0
+                   * r.work / (r.nslots*r.makespan) : 0.0,
+                   sim_time(r.tail,buf2));
+            continue;
+        }
+
+        printf("\nSlots:        %d\n",r.nslots);
+        printf("Makespan:     %s (%.1f s)\n",
+               sim_time(r.makespan,buf1),r.makespan);
+        printf("Total work:   %.1f slot hours\n",r.work/3600.0);
+        printf("Utilization:  %.1f%%\n",(r.makespan > 0.0) ? 100.0
+               * r.work / (r.nslots*r.makespan) : 0.0);
+        printf("Tail:         %s (%.1f s) from first idle slot to end\n",
+               sim_time(r.tail,buf1),r.tail);
+        if (r.makespan <= 0.0) continue;
+        printf("\nUtilization over time:\n");
+        for (j = 0; j < SIM_NBINS; ++j)
+            printf("%12s %6.1f%% %.*s\n",
+                   sim_time(j*r.makespan/SIM_NBINS,buf1),100.0*r.util[j],
+                   (int)(50.0*r.util[j]+0.5),
+                   "##################################################");
+    }
+    free((void *)list);
+    return 0;
+}
+
+/*
+ * Local Variables:
+ * c-basic-offset: 4
+ * auto-revert-buffer: 't
+ * compile-command: "make -k -C ../ fedora"
+ * End:
+ */
@@ -0,0 +1,82 @@
+
+/*
+ * Torque task list launcher tool.
+ *
+ * Copyright (c) 2015,2017 Axel Kohlmeyer <akohlmey@gmail.com>
+ */
+
+/* API for predicting the makespan of a task list by simulation */
+
+#ifndef TL_SIMULATE_H
+#define TL_SIMULATE_H
+
+#include "task-mgr.h"
+
+/** number of intervals of the reported utilization curve */
+#define SIM_NBINS 20
+
+typedef struct {
+    int ntasks;         /* number of tasks to simulate */
+    int nknown;         /* number of tasks with a runtime estimate */
+    double fallback;    /* runtime assumed for tasks without estimate */
+    double rate;        /* maximum launches per second or 0 */
+    double *runtime;    /* runtime estimates in order of launch */
+    double *start;      /* simulated start times of the tasks */
+} sim_t;
+
+typedef struct {
+    int nslots;         /* number of slots simulated */
+    double makespan;    /* time until the last task is finished */
+    double work;        /* sum of all task runtimes */
+    double tail;        /* time from the first slot running out of
+                           tasks until the last task is finished */
+    double util[SIM_NBINS]; /* fraction of busy slots over time */
+} sim_result_t;
+
+/*! Collect runtime estimates of the queued tasks in launch order.
+ * Estimates are taken from a "runtime" annotation of the task, from
+ * a history file, or the given default in that order. Each line of
+ * a history file holds a runtime in seconds followed by the command
+ * as in the task list; the average of repeated entries is used.
+ * \param t task list struct allocated by task_mgr_init
+ * \param history name of runtime history file or NULL
+ * \param runtime runtime of tasks without estimate, 0 for the average
+ * \param rate maximum number of launches per second, 0 for unlimited
+ * \return allocated simulation struct or NULL on failure
+ */
+sim_t *sim_init(task_mgr_t *t, const char *history, double runtime,
+                double rate);
+
+/*! Free simulation struct
+ * \param s simulation struct allocated by sim_init
+ */
+void sim_exit(sim_t *s);
+
+/*! Simulate processing the tasks with a given number of slots.
+ * Each task is launched on the slot that becomes idle first.
+ * \param s simulation struct allocated by sim_init
+ * \param nslots number of slots
+ * \param r result of the simulation
+ * \return 0 if successful, other on failure
+ */
+int sim_run(sim_t *s, int nslots, sim_result_t *r);
+
+/*! Simulate a list of slot counts and print the results.
+ * The list is comma separated, with ranges given as first-last or
+ * first-last:step. For a single slot count the utilization over
+ * time is printed as well.
+ * \param s simulation struct allocated by sim_init
+ * \param slots list of slot counts
+ * \return 0 if successful, other on failure
+ */
+int sim_report(sim_t *s, const char *slots);
+
+#endif
+
+/*
+ * Local Variables:
+ * c-basic-offset: 4
+ * auto-revert-buffer: 't
+ * compile-command: "make -k -C ../ fedora"
+ * End:
+ */
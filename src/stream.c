@@ -0,0 +1,342 @@
+
+/*
+ * Torque task list launcher tool.
+ *
+ * Copyright (c) 2015,2017 Axel Kohlmeyer <akohlmey@gmail.com>
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "stream.h"
+
+static const char *typename[] = {
+    "plain", "gzip", "zstd", NULL
+};
+
+/* ---------------------------------------- */
+
+static stream_t *stream_alloc(int type)
+{
+    stream_t *s = (stream_t *)calloc(1,sizeof(stream_t));
+    if (s == NULL) return NULL;
+    s->type = type;
+    s->buf = (char *)malloc(STREAM_BUFSZ);
+    if (s->buf == NULL) {
+        free((void *)s);
+        return NULL;
+    }
+    return s;
+}
+
+/* ---------------------------------------- */
+
+/* refill buffer with the next chunk of decompressed data */
+static size_t stream_fill(stream_t *s)
+{
+    s->pos = s->len = 0;
+    if (s->eof) return 0;
+
+    switch (s->type) {
+
+    case STREAM_PLAIN:
+        s->len = fread(s->buf,1,STREAM_BUFSZ,s->fp);
+        if (ferror(s->fp)) {
+            perror("Error reading file");
+            s->error = 1;
+        }
+        break;
+
+#ifdef USE_ZLIB
+    case STREAM_GZIP: {
+        const char *msg;
+        int n,err;
+
+        n = gzread((gzFile)s->z,s->buf,STREAM_BUFSZ);
+        s->len = (n > 0) ? n : 0;
+        /* a truncated file is reported as Z_BUF_ERROR after
+           the last complete data has been returned */
+        msg = gzerror((gzFile)s->z,&err);
+        if ((n < 0) || ((err != Z_OK) && (err != Z_STREAM_END))) {
+            printf("Error decompressing gzip data: %s\n",
+                   (err == Z_BUF_ERROR) ? "unexpected end of file" : msg);
+            s->error = 1;
+        }
+        break;
+    }
+#endif
+
+#ifdef USE_ZSTD
+    case STREAM_ZSTD:
+        while (s->len == 0) {
+            ZSTD_inBuffer in;
+            ZSTD_outBuffer out;
+            size_t rv;
+
+            if ((s->zpos == s->zlen) && !s->more) {
+                s->zlen = fread(s->zbuf,1,ZSTD_DStreamInSize(),s->fp);
+                s->zpos = 0;
+                if (ferror(s->fp)) {
+                    perror("Error reading file");
+                    s->error = 1;
+                    break;
+                }
+                if (s->zlen == 0) {
+                    if (s->frame) {
+                        printf("Error decompressing zstd data: "
+                               "unexpected end of file\n");
+                        s->error = 1;
+                    }
+                    break;
+                }
+            }
+            in.src = s->zbuf;
+            in.size = s->zlen;
+            in.pos = s->zpos;
+            out.dst = s->buf;
+            out.size = STREAM_BUFSZ;
+            out.pos = 0;
+            rv = ZSTD_decompressStream((ZSTD_DCtx *)s->z,&out,&in);
+            if (ZSTD_isError(rv)) {
+                printf("Error decompressing zstd data: %s\n",
+                       ZSTD_getErrorName(rv));
+                s->error = 1;
+                break;
+            }
+            s->zpos = in.pos;
+            s->len = out.pos;
+            s->more = (out.pos == out.size);
+            s->frame = (rv != 0);
+        }
+        break;
+#endif
+    }
+
+    if (s->error) s->len = 0;
+    if (s->len == 0) s->eof = 1;
+    return s->len;
+}
+
+/* ---------------------------------------- */
+
+stream_t *stream_open(const char *name)
+{
+    stream_t *s;
+    FILE *fp;
+    unsigned char magic[4];
+    size_t n;
+    int type;
+
+    if (name == NULL) return NULL;
+    fp = fopen(name,"rb");
+    if (fp == NULL) return NULL;
+
+    /* detect compression from magic bytes */
+    n = fread(magic,1,4,fp);
+    type = STREAM_PLAIN;
+    if ((n >= 2) && (magic[0] == 0x1f) && (magic[1] == 0x8b))
+        type = STREAM_GZIP;
+    else if ((n == 4) && (magic[0] == 0x28) && (magic[1] == 0xb5)
+             && (magic[2] == 0x2f) && (magic[3] == 0xfd))
+        type = STREAM_ZSTD;
+    rewind(fp);
+
+    s = stream_alloc(type);
+    if (s == NULL) {
+        fclose(fp);
+        return NULL;
+    }
+
+    switch (type) {
+
+    case STREAM_PLAIN:
+        s->fp = fp;
+        return s;
+
+#ifdef USE_ZLIB
+    case STREAM_GZIP:
+        fclose(fp);
+        s->z = (void *)gzopen(name,"rb");
+        if (s->z == NULL) break;
+        gzbuffer((gzFile)s->z,STREAM_BUFSZ);
+        return s;
+#endif
+
+#ifdef USE_ZSTD
+    case STREAM_ZSTD:
+        s->fp = fp;
+        s->z = (void *)ZSTD_createDCtx();
+        s->zbuf = (char *)malloc(ZSTD_DStreamInSize());
+        if ((s->z == NULL) || (s->zbuf == NULL)) {
+            stream_close(s);
+            return NULL;
+        }
+        return s;
+#endif
+
+    default:
+        printf("Support for %s compressed files is not available.\n",
+               typename[type]);
+        fclose(fp);
+    }
+
+    free((void *)s->buf);
+    free((void *)s);
+    return NULL;
+}
+
+/* ---------------------------------------- */
+
+stream_t *stream_create(const char *name)
+{
+    stream_t *s;
+
+    if (name == NULL) return NULL;
+    s = stream_alloc(STREAM_PLAIN);
+    if (s == NULL) return NULL;
+
+    /* write to a temporary file, so that an interrupted write
+       does not destroy the previous version of the file */
+    s->name = strdup(name);
+    s->tmpname = (char *)malloc(strlen(name)+5);
+    if ((s->name == NULL) || (s->tmpname == NULL)) {
+        stream_close(s);
+        return NULL;
+    }
+    sprintf(s->tmpname,"%s.tmp",name);
+
+#ifdef USE_ZLIB
+    {
+        size_t len = strlen(name);
+        if ((len > 3) && (strcmp(name+len-3,".gz") == 0)) {
+            s->type = STREAM_GZIP;
+            s->z = (void *)gzopen(s->tmpname,"wb");
+        } else s->fp = fopen(s->tmpname,"w");
+    }
+#else
+    s->fp = fopen(s->tmpname,"w");
+#endif
+    if ((s->fp != NULL) || (s->z != NULL)) return s;
+
+    stream_close(s);
+    return NULL;
+}
+
+/* ---------------------------------------- */
+
+char *stream_gets(char *buf, int len, stream_t *s)
+{
+    size_t n,avail;
+    char *nl;
+
+    if ((s == NULL) || (buf == NULL) || (len < 2)) return NULL;
+
+    n = 0;
+    while (n < (size_t)len-1) {
+        if ((s->pos == s->len) && (stream_fill(s) == 0)) break;
+
+        avail = s->len - s->pos;
+        if (avail > (size_t)len-1-n) avail = (size_t)len-1-n;
+        nl = (char *)memchr(s->buf+s->pos,'\n',avail);
+        if (nl != NULL) avail = nl - (s->buf+s->pos) + 1;
+
+        memcpy(buf+n,s->buf+s->pos,avail);
+        n += avail;
+        s->pos += avail;
+        if (nl != NULL) break;
+    }
+
+    if (n == 0) return NULL;
+    buf[n] = '\0';
+    if (s->error) return NULL;
+    return buf;
+}
+
+/* ---------------------------------------- */
+
+int stream_error(stream_t *s)
+{
+    if (s == NULL) return 1;
+    return s->error;
+}
+
+/* ---------------------------------------- */
+
+int stream_printf(stream_t *s, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if ((s == NULL) || (fmt == NULL)) return -1;
+    va_start(ap,fmt);
+#ifdef USE_ZLIB
+    if (s->type == STREAM_GZIP) {
+        n = vsnprintf(s->buf,STREAM_BUFSZ,fmt,ap);
+        if (n >= STREAM_BUFSZ) n = STREAM_BUFSZ-1;
+        if ((n > 0) && (gzwrite((gzFile)s->z,s->buf,n) != n)) n = -1;
+    } else
+#endif
+        n = vfprintf(s->fp,fmt,ap);
+    va_end(ap);
+    if (n < 0) s->error = 1;
+    return n;
+}
+
+/* ---------------------------------------- */
+
+int stream_close(stream_t *s)
+{
+    int rv = 0;
+
+    if (s == NULL) return 0;
+#ifdef USE_ZLIB
+    if ((s->type == STREAM_GZIP) && (s->z != NULL))
+        rv = (gzclose((gzFile)s->z) != Z_OK);
+#endif
+#ifdef USE_ZSTD
+    if ((s->type == STREAM_ZSTD) && (s->z != NULL))
+        ZSTD_freeDCtx((ZSTD_DCtx *)s->z);
+#endif
+    if ((s->fp != NULL) && (fclose(s->fp) != 0))
+        rv = 1;
+
+    /* replace the file only if it was written completely */
+    if (s->tmpname != NULL) {
+        if ((s->fp != NULL) || (s->z != NULL)) {
+            if ((rv == 0) && !s->error) {
+                if (rename(s->tmpname,s->name) != 0) {
+                    perror("Error renaming temporary file");
+                    rv = 1;
+                }
+            } else {
+                unlink(s->tmpname);
+                rv = 1;
+            }
+        }
+        free((void *)s->name);
+        free((void *)s->tmpname);
+    }
+    free((void *)s->zbuf);
+    free((void *)s->buf);
+    free((void *)s);
+    return rv;
+}
+
+/*
+ * Local Variables:
+ * c-basic-offset: 4
+ * auto-revert-buffer: 't
+ * compile-command: "make -k -C ../ fedora"
+ * End:
+ */
@@ -0,0 +1,96 @@
+
+/*
+ * Torque task list launcher tool.
+ *
+ * Copyright (c) 2015,2017 Axel Kohlmeyer <akohlmey@gmail.com>
+ */
+
+/* API for reading and writing (compressed) text files line by line */
+
+#ifndef TL_STREAM_H
+#define TL_STREAM_H
+
+#include <stdio.h>
+
+/* stream types */
+#define STREAM_PLAIN 0
+#define STREAM_GZIP  1
+#define STREAM_ZSTD  2
+
+/** size of buffer for decompressed data */
+#define STREAM_BUFSZ 65536
+
+typedef struct {
+    int type;           /* compression type, see STREAM_* */
+    FILE *fp;           /* file handle for plain and zstd files */
+    void *z;            /* gzFile or ZSTD_DCtx handle */
+    char *zbuf;         /* buffer for compressed data */
+    size_t zlen;        /* bytes in compressed data buffer */
+    size_t zpos;        /* read position in compressed data buffer */
+    int more;           /* nonzero if decompressor holds more output */
+    char *buf;          /* buffer for decompressed data */
+    size_t len;         /* bytes in decompressed data buffer */
+    size_t pos;         /* read position in decompressed data buffer */
+    int eof;            /* nonzero when all data has been read */
+    int frame;          /* nonzero while inside an incomplete zstd frame */
+    int error;          /* nonzero after a read or write error */
+    char *name;         /* name of created file */
+    char *tmpname;      /* name the created file is written to */
+} stream_t;
+
+/*! Open a text file for reading.
+ * gzip and zstd compressed files are detected by their magic bytes
+ * and transparently decompressed.
+ * \param name name of file to open
+ * \return stream struct or NULL on failure
+ */
+stream_t *stream_open(const char *name);
+
+/*! Create a text file for writing.
+ * The file is gzip compressed, if its name ends in ".gz".
+ * Data is written to a temporary file, which replaces the file
+ * only when the stream is closed without error.
+ * \param name name of file to create
+ * \return stream struct or NULL on failure
+ */
+stream_t *stream_create(const char *name);
+
+/*! Read next line from stream, like fgets().
+ * \param buf buffer for line
+ * \param len size of buffer
+ * \param s stream struct allocated by stream_open
+ * \return buf or NULL at end of file or on error
+ */
+char *stream_gets(char *buf, int len, stream_t *s);
+
+/*! Check whether reading or writing the stream failed.
+ * Use after stream_gets() returned NULL to tell an error from
+ * the end of the file.
+ * \param s stream struct allocated by stream_open or stream_create
+ * \return 0 if no error occurred, other after an error
+ */
+int stream_error(stream_t *s);
+
+/*! Write formatted text to stream, like fprintf()
+ * \param s stream struct allocated by stream_create
+ * \param fmt format string
+ * \return number of bytes written or negative value on error
+ */
+int stream_printf(stream_t *s, const char *fmt, ...);
+
+/*! Close stream and free stream struct. A created file replaces
+ * an existing file of the same name only if all writes succeeded.
+ * \param s stream struct allocated by stream_open or stream_create
+ * \return 0 if successful, other if writing failed
+ */
+int stream_close(stream_t *s);
+
+#endif
+
+/*
+ * Local Variables:
+ * c-basic-offset: 4
+ * auto-revert-buffer: 't
+ * compile-command: "make -k -C ../ fedora"
+ * End:
+ */
@@ -12,11 +12,7 @@
 #include <time.h>
 
 #include "task-mgr.h"
-
-#define TASK_PENDING   0
-#define TASK_RUNNING   1
-#define TASK_COMPLETE  2
-#define TASK_FAILED    3
+#include "stream.h"
 
 /** time in seconds between writing checkpoint files */
 #define CHECKPOINT_RATE 30
@@ -31,14 +27,29 @@ task_mgr_t *task_mgr_init(int num)
 {
     task_mgr_t *t = (task_mgr_t *)malloc(sizeof(task_mgr_t));
     if (t == NULL) return NULL;
-    t->task = (task_t *)calloc(num,sizeof(task_t));
+    t->task = (task_t *)calloc(num > 0 ? num : 1,sizeof(task_t));
     if (t->task == NULL) {
         free((void *)t);
         return NULL;
     }
+    t->queue = (int *)malloc((num > 0 ? num : 1)*sizeof(int));
+    t->wait = (int *)malloc((num > 0 ? num : 1)*sizeof(int));
+    if ((t->queue == NULL) || (t->wait == NULL)) {
+        free((void *)t->queue);
+        free((void *)t->wait);
+        free((void *)t->task);
+        free((void *)t);
+        return NULL;
+    }
     t->nmax = num;
     t->nall = 0;
-    t->nlast = 0;
+    t->qhead = 0;
+    t->nqueue = 0;
+    t->nwait = 0;
+    t->maxtry = 1;
+    t->delay = 0;
+    t->ncodes = 0;
+    t->codes = NULL;
     return t;
 }
 
@@ -52,15 +63,50 @@ void task_mgr_exit(task_mgr_t *t)
             for (i = 0; i < t->nmax; ++i) {
                 if (t->task[i].cmd != NULL)
                     free((void *)t->task[i].cmd);
+                free((void *)t->task[i].failed);
             }
             free((void *)t->task);
         }
+        free((void *)t->queue);
+        free((void *)t->wait);
+        free((void *)t->codes);
         free((void *)t);
     }
 }
 
 /* ---------------------------------------- */
 
+/* double the capacity of the task list */
+static int task_mgr_grow(task_mgr_t *t)
+{
+    task_t *task;
+    int *queue,*wait;
+    int i,num;
+
+    num = (t->nmax > 0) ? 2*t->nmax : 1024;
+    task = (task_t *)realloc(t->task,num*sizeof(task_t));
+    if (task == NULL) return 1;
+    memset(task+t->nmax,0,(num-t->nmax)*sizeof(task_t));
+    t->task = task;
+
+    wait = (int *)realloc(t->wait,num*sizeof(int));
+    if (wait == NULL) return 1;
+    t->wait = wait;
+
+    /* unwrap ring buffer of pending tasks */
+    queue = (int *)malloc(num*sizeof(int));
+    if (queue == NULL) return 1;
+    for (i = 0; i < t->nqueue; ++i)
+        queue[i] = t->queue[(t->qhead + i) % t->nmax];
+    free((void *)t->queue);
+    t->queue = queue;
+    t->qhead = 0;
+    t->nmax = num;
+    return 0;
+}
+
+/* ---------------------------------------- */
+
 int task_mgr_add(task_mgr_t *t, const char *cmd)
 {
     int n;
@@ -73,7 +119,7 @@ int task_mgr_add(task_mgr_t *t, const char *cmd)
 
     n = t->nall;
     /* no more reserved space left */
-    if (n == t->nmax) return 3;
+    if ((n == t->nmax) && (task_mgr_grow(t) != 0)) return 3;
 
     /* copy command and init data structure */
     t->task[n].cmd = strdup(cmd);
@@ -83,7 +129,7 @@ int task_mgr_add(task_mgr_t *t, const char *cmd)
     t->task[n].taskid = TM_NULL_TASK;
     t->task[n].tasknum = n;
     t->nall = n+1;
-    return 0;
+    return task_mgr_queue(t,n);
 }
 
 /* ---------------------------------------- */
@@ -99,18 +145,118 @@ int task_mgr_nall(task_mgr_t *t)
 int task_mgr_todo(task_mgr_t *t)
 {
     if (t == NULL) return 0;
-    return t->nall - t->nlast;
+    return t->nqueue + t->nwait;
+}
+
+/* ---------------------------------------- */
+
+int task_mgr_nqueue(task_mgr_t *t)
+{
+    if (t == NULL) return 0;
+    return t->nqueue;
+}
+
+/* ---------------------------------------- */
+
+int task_mgr_queue(task_mgr_t *t, int num)
+{
+    if (t == NULL) return 1;
+    if ((num < 0) || (num >= t->nall)) return 2;
+    /* every task can be queued only once at a time */
+    if (t->nqueue == t->nmax) return 3;
+
+    t->queue[(t->qhead + t->nqueue) % t->nmax] = num;
+    t->task[num].status = TASK_PENDING;
+    t->nqueue++;
+    return 0;
+}
+
+/* ---------------------------------------- */
+
+void task_mgr_clear(task_mgr_t *t)
+{
+    if (t == NULL) return;
+    t->qhead = 0;
+    t->nqueue = 0;
+}
+
+/* ---------------------------------------- */
+
+task_t *task_mgr_peek(task_mgr_t *t, int num)
+{
+    if ((t == NULL) || (num < 0) || (num >= t->nqueue)) return NULL;
+    return &(t->task[t->queue[(t->qhead + num) % t->nmax]]);
+}
+
+/* ---------------------------------------- */
+
+int task_mgr_retry(task_mgr_t *t, int maxtry, const char *codes, int delay)
+{
+    const char *ptr;
+    char *end;
+    int n;
+
+    if (t == NULL) return 1;
+    t->maxtry = (maxtry > 0) ? maxtry : 1;
+    t->delay = (delay > 0) ? delay : 0;
+    free((void *)t->codes);
+    t->codes = NULL;
+    t->ncodes = 0;
+    if (codes == NULL) return 0;
+
+    /* count and convert comma separated list of exit codes */
+    n = 1;
+    for (ptr = codes; *ptr != '\0'; ++ptr)
+        if (*ptr == ',') ++n;
+    t->codes = (int *)malloc(n*sizeof(int));
+    if (t->codes == NULL) return 2;
+
+    ptr = codes;
+    while (t->ncodes < n) {
+        t->codes[t->ncodes] = strtol(ptr,&end,10);
+        if ((end == ptr) || ((*end != ',') && (*end != '\0'))) return 3;
+        t->ncodes++;
+        ptr = end + 1;
+    }
+    return 0;
 }
 
 /* ---------------------------------------- */
 
 task_t *task_mgr_next(task_mgr_t *t)
 {
-    if (t == NULL) return NULL;
-    if (t->nlast < t->nall) {
-        task_t *n = &(t->task[t->nlast]);
+    return task_mgr_take(t,0);
+}
+
+/* ---------------------------------------- */
+
+task_t *task_mgr_take(task_mgr_t *t, int num)
+{
+    time_t now;
+    int i,j;
+
+    if ((t == NULL) || (num < 0)) return NULL;
+
+    /* move tasks whose retry delay is over to the pending queue */
+    if (t->nwait > 0) {
+        now = time(NULL);
+        for (i = j = 0; i < t->nwait; ++i) {
+            if (t->task[t->wait[i]].notbefore <= now)
+                task_mgr_queue(t,t->wait[i]);
+            else t->wait[j++] = t->wait[i];
+        }
+        t->nwait = j;
+    }
+
+    if (num < t->nqueue) {
+        task_t *n = &(t->task[t->queue[(t->qhead + num) % t->nmax]]);
+        /* close the gap by moving the tasks in front of it back */
+        for (i = num; i > 0; --i)
+            t->queue[(t->qhead + i) % t->nmax]
+                = t->queue[(t->qhead + i - 1) % t->nmax];
         n->status = TASK_RUNNING;
-        t->nlast++;
+        t->qhead = (t->qhead + 1) % t->nmax;
+        t->nqueue--;
         return n;
     }
     return NULL;
@@ -133,8 +279,8 @@ void task_mgr_print(task_mgr_t *t)
 
 void task_mgr_chkpnt(task_mgr_t *t, const char *n)
 {
-    FILE *fp;
-    int i;
+    stream_t *fp;
+    int i,j,nfail,len;
     static time_t lasttime = 0;
     time_t curtime;
     if ((t == NULL) || (n == NULL)) return;
@@ -145,28 +291,99 @@ void task_mgr_chkpnt(task_mgr_t *t, const char *n)
         lasttime = curtime;
     else return;
 
-    fp = fopen(n,"w");
+    fp = stream_create(n);
     if (fp != NULL) {
         const char *prefix;
 
-        fprintf(fp,"# torque-launch checkpoint written: %s",ctime(&curtime));
+        stream_printf(fp,"# torque-launch checkpoint written: %s",
+                      ctime(&curtime));
         for (i = 0; i < t->nall; ++i) {
-            prefix = (t->task[i].status == TASK_COMPLETE) ? "# " : "";
-            fprintf(fp,"%s%s",prefix,t->task[i].cmd);
+            const task_t *k = t->task + i;
+            /* failed attempts are recorded as comments */
+            if (k->failed != NULL) {
+                nfail = (k->status == TASK_COMPLETE) ? k->ntry-1 : k->ntry;
+                stream_printf(fp,"# failed attempts:");
+                for (j = 0; j < nfail; ++j)
+                    stream_printf(fp,"%s exit %d on slot %d",
+                                  (j > 0) ? "," : "",
+                                  k->failed[j].exitval,k->failed[j].nodeid);
+                stream_printf(fp,"\n");
+            }
+            prefix = (k->status == TASK_COMPLETE) ? "# " : "";
+            /* the last line of the task list may lack a newline */
+            len = strlen(k->cmd);
+            stream_printf(fp,"%s%s%s",prefix,k->cmd,
+                          ((len > 0) && (k->cmd[len-1] == '\n')) ? "" : "\n");
         }
-        fclose(fp);
+        /* the previous checkpoint is kept, if writing failed */
+        if (stream_close(fp) != 0)
+            printf("Error writing checkpoint file '%s'.\n",n);
     }
 }
 
 /* ---------------------------------------- */
 
-void task_done(task_t *t)
+void task_done(task_mgr_t *m, task_t *t)
 {
+    attempt_t *a;
+    int i,retry;
+
     if (t == NULL) return;
-    if (t->exitval != 0)
-        t->status = TASK_FAILED;
-    else
+    t->ntry++;
+    if (t->exitval == 0) {
         t->status = TASK_COMPLETE;
+        return;
+    }
+    t->status = TASK_FAILED;
+
+    /* keep history of failed attempts */
+    a = (attempt_t *)realloc(t->failed,t->ntry*sizeof(attempt_t));
+    if (a != NULL) {
+        t->failed = a;
+        a[t->ntry-1].exitval = t->exitval;
+        a[t->ntry-1].nodeid = t->nodeid;
+    }
+
+    if ((m == NULL) || (t->ntry >= m->maxtry)) return;
+    retry = (m->ncodes == 0);
+    for (i = 0; i < m->ncodes; ++i)
+        if (m->codes[i] == t->exitval) retry = 1;
+    if (!retry) return;
+
+    /* back off exponentially with the number of attempts */
+    i = (t->ntry < 16) ? t->ntry-1 : 15;
+    t->notbefore = time(NULL) + ((time_t)m->delay << i);
+    t->status = TASK_PENDING;
+    m->wait[m->nwait++] = t->tasknum;
+}
+
+/* ---------------------------------------- */
+
+char *task_annotation(const task_t *t, const char *key, char *buf, int len)
+{
+    const char *ptr;
+    int klen,n;
+
+    if ((t == NULL) || (t->cmd == NULL) || (key == NULL)) return NULL;
+    if ((buf == NULL) || (len < 1)) return NULL;
+    ptr = strstr(t->cmd,"#@");
+    if (ptr == NULL) return NULL;
+
+    klen = strlen(key);
+    ptr += 2;
+    while (*ptr != '\0') {
+        while (isspace(*ptr)) ++ptr;
+        if ((strncmp(ptr,key,klen) == 0) && (ptr[klen] == '=')) {
+            ptr += klen+1;
+            for (n = 0; (n < len-1) && (ptr[n] != '\0')
+                     && !isspace(ptr[n]); ++n)
+                buf[n] = ptr[n];
+            buf[n] = '\0';
+            return buf;
+        }
+        while ((*ptr != '\0') && !isspace(*ptr)) ++ptr;
+    }
+    return NULL;
 }
 
 /* ---------------------------------------- */
@@ -10,13 +10,37 @@
 #ifndef TL_TASK_MGR_H
 #define TL_TASK_MGR_H
 
+#include <time.h>
+
 #include "torque.h"
 
+/* task status flags */
+#define TASK_PENDING   0
+#define TASK_RUNNING   1
+#define TASK_COMPLETE  2
+#define TASK_FAILED    3
+
+/* input staging flags */
+#define STAGE_UNKNOWN  0        /* input files not yet checked */
+#define STAGE_NONE     1        /* no input files to be staged */
+#define STAGE_COPY     2        /* input files are being copied */
+#define STAGE_READY    3        /* input files are available on stage host */
+
+typedef struct {
+    int exitval;
+    tm_node_id nodeid;
+} attempt_t;
+
 typedef struct {
     const char *cmd;
     int status;
     int exitval;
     int tasknum;
+    int ntry;           /* number of completed attempts */
+    attempt_t *failed;  /* exit status and node of failed attempts */
+    time_t notbefore;   /* earliest time for next attempt */
+    int stage;          /* input staging status, see STAGE_* */
+    int stagehost;      /* index of host with staged input files */
     tm_node_id nodeid;
     tm_task_id taskid;
 } task_t;
@@ -24,7 +48,15 @@ typedef struct {
 typedef struct {
     int nall;
     int nmax;
-    int nlast;
+    int qhead;          /* first entry in ring buffer of pending tasks */
+    int nqueue;         /* number of entries in ring buffer */
+    int *queue;         /* ring buffer with indices of pending tasks */
+    int nwait;          /* number of tasks waiting to be retried */
+    int *wait;          /* indices of tasks waiting to be retried */
+    int maxtry;         /* maximum number of attempts per task */
+    int delay;          /* delay in seconds before first retry */
+    int ncodes;         /* number of retryable exit codes, 0 means all */
+    int *codes;         /* list of retryable exit codes */
     task_t *task;
 } task_mgr_t;
 
@@ -68,12 +100,57 @@ int task_mgr_nall(task_mgr_t *t);
  */
 int task_mgr_todo(task_mgr_t *t);
 
-/*! Return next pending command in task list
+/*! Return number of queued tasks in task list, not counting failed
+ * tasks that wait for their retry delay to expire
  * \param t task list struct allocated by task_mgr_init
- * \return command string
+ * \return number of tasks
+ */
+int task_mgr_nqueue(task_mgr_t *t);
+
+/*! Append a task to the queue of pending tasks
+ * \param t task list struct allocated by task_mgr_init
+ * \param num index of task in task list
+ * \return 0 if successful, other if queueing failed.
+ */
+int task_mgr_queue(task_mgr_t *t, int num);
+
+/*! Remove all tasks from the queue of pending tasks
+ * \param t task list struct allocated by task_mgr_init
+ */
+void task_mgr_clear(task_mgr_t *t);
+
+/*! Return a pending task without removing it from the queue
+ * \param t task list struct allocated by task_mgr_init
+ * \param num position in the queue of pending tasks
+ * \return task or NULL if there are fewer pending tasks
+ */
+task_t *task_mgr_peek(task_mgr_t *t, int num);
+
+/*! Configure automatic retry of failed tasks
+ * \param t task list struct allocated by task_mgr_init
+ * \param maxtry maximum number of attempts per task
+ * \param codes comma separated list of retryable exit codes or NULL for all
+ * \param delay delay in seconds before the first retry, doubled for each
+ *  following retry
+ * \return 0 if successful, other if the list of exit codes is invalid.
+ */
+int task_mgr_retry(task_mgr_t *t, int maxtry, const char *codes, int delay);
+
+/*! Return next pending command in task list.
+ * Tasks waiting for a retry are queued again once their delay is over.
+ * \param t task list struct allocated by task_mgr_init
+ * \return task or NULL if no task is ready
  */
 task_t *task_mgr_next(task_mgr_t *t);
 
+/*! Remove a pending task from anywhere in the queue, like
+ * task_mgr_next() does for the first one.
+ * \param t task list struct allocated by task_mgr_init
+ * \param num position in the queue of pending tasks
+ * \return task or NULL if there are fewer pending tasks
+ */
+task_t *task_mgr_take(task_mgr_t *t, int num);
+
 /*! Print task list
  * \param t task list struct allocated by task_mgr_init
  */
@@ -85,10 +162,22 @@ void task_mgr_print(task_mgr_t *t);
  */
 void task_mgr_chkpnt(task_mgr_t *t, const char *n);
 
-/*! Change status of completed task
+/*! Change status of completed task and schedule a retry, if applicable
+ * \param m task list struct allocated by task_mgr_init
+ * \param t task list element
+ */
+void task_done(task_mgr_t *m, task_t *t);
+
+/*! Look up an annotation of a task. Annotations are key=value pairs
+ * separated by whitespace after a "#@" marker at the end of the task,
+ * e.g. "myprog input.dat #@ input=input.dat runtime=600".
  * \param t task list element
+ * \param key name of the annotation
+ * \param buf buffer for value of the annotation
+ * \param len size of buffer
+ * \return buf or NULL if the task has no such annotation
  */
-void task_done(task_t *t);
+char *task_annotation(const task_t *t, const char *key, char *buf, int len);
 
 /*! Reorder list of tasks in one of several ways
  * \param t task list struct allocated by task_mgr_init()
@@ -0,0 +1,260 @@
+
+/*
+ * Torque task list launcher tool.
+ *
+ * Copyright (c) 2015,2017 Axel Kohlmeyer <akohlmey@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "topology.h"
+
+/** location of CPU and NUMA node information in sysfs */
+#define SYSDIR "/sys/devices/system"
+
+/** maximum length of a CPU list in sysfs */
+#define LISTSZ 4096
+
+/** maximum number of logical CPUs supported */
+#define MAXCPU CPU_SETSIZE
+
+/* ---------------------------------------- */
+
+static int read_line(const char *file, char *buf, int len)
+{
+    FILE *fp = fopen(file,"r");
+    if (fp == NULL) return 1;
+    if (fgets(buf,len,fp) == NULL) {
+        fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* ---------------------------------------- */
+
+/* set flags for all entries of a list like "0-3,8,10-11" */
+static void parse_list(const char *s, char *flag, int max)
+{
+    char *end;
+    int a,b;
+
+    while (*s != '\0') {
+        a = strtol(s,&end,10);
+        if (end == s) break;
+        b = a;
+        if (*end == '-') {
+            s = end+1;
+            b = strtol(s,&end,10);
+            if (end == s) break;
+        }
+        for (; (a <= b) && (a < max); ++a)
+            if (a >= 0) flag[a] = 1;
+        s = end;
+        if (*s != ',') break;
+        ++s;
+    }
+}
+
+/* ---------------------------------------- */
+
+static int core_cmp(const void *a, const void *b)
+{
+    const core_t *ca = (const core_t *)a;
+    const core_t *cb = (const core_t *)b;
+    if (ca->node != cb->node) return ca->node - cb->node;
+    return ca->cpu[0] - cb->cpu[0];
+}
+
+/* ---------------------------------------- */
+
+topology_t *topology_init()
+{
+    char path[256],buf[LISTSZ];
+    char *usable,*online,*flag;
+    int *node,*key;
+    cpu_set_t mask;
+    topology_t *t;
+    core_t *c;
+    int i,j,m,num;
+
+    t = (topology_t *)calloc(1,sizeof(topology_t));
+    usable = (char *)calloc(MAXCPU,1);
+    online = (char *)calloc(MAXCPU,1);
+    flag = (char *)calloc(MAXCPU,1);
+    node = (int *)calloc(MAXCPU,sizeof(int));
+    key = (int *)malloc(MAXCPU*sizeof(int));
+    if (t != NULL)
+        t->core = (core_t *)calloc(MAXCPU,sizeof(core_t));
+    if ((t == NULL) || (t->core == NULL) || (usable == NULL)
+        || (online == NULL) || (flag == NULL) || (node == NULL)
+        || (key == NULL)) {
+        topology_exit(t);
+        free((void *)usable);
+        free((void *)online);
+        free((void *)flag);
+        free((void *)node);
+        free((void *)key);
+        return NULL;
+    }
+
+    /* online CPUs that are in our affinity mask (e.g. the job cpuset) */
+    if (read_line(SYSDIR "/cpu/online",buf,LISTSZ) == 0) {
+        parse_list(buf,usable,MAXCPU);
+    } else {
+        num = sysconf(_SC_NPROCESSORS_ONLN);
+        for (i = 0; (i < num) && (i < MAXCPU); ++i) usable[i] = 1;
+    }
+    if (sched_getaffinity(0,sizeof(mask),&mask) == 0) {
+        for (i = 0; i < MAXCPU; ++i)
+            if (!CPU_ISSET(i,&mask)) usable[i] = 0;
+    }
+
+    /* NUMA node of each CPU. without NUMA information all are on node 0 */
+    if (read_line(SYSDIR "/node/online",buf,LISTSZ) == 0) {
+        parse_list(buf,online,MAXCPU);
+        for (m = 0; m < MAXCPU; ++m) {
+            if (!online[m]) continue;
+            snprintf(path,sizeof(path),SYSDIR "/node/node%d/cpulist",m);
+            if (read_line(path,buf,LISTSZ) != 0) continue;
+            memset(flag,0,MAXCPU);
+            parse_list(buf,flag,MAXCPU);
+            for (i = 0; i < MAXCPU; ++i)
+                if (flag[i]) node[i] = m;
+        }
+    }
+
+    /* hardware threads of the same core share the first sibling id */
+    for (i = 0; i < MAXCPU; ++i) {
+        key[i] = i;
+        if (!usable[i]) continue;
+        snprintf(path,sizeof(path),
+                 SYSDIR "/cpu/cpu%d/topology/thread_siblings_list",i);
+        if (read_line(path,buf,LISTSZ) == 0)
+            key[i] = atoi(buf);
+    }
+
+    /* group usable CPUs into cores */
+    for (i = 0; i < MAXCPU; ++i) {
+        if (!usable[i]) continue;
+        for (j = 0; j < t->ncores; ++j)
+            if (key[t->core[j].cpu[0]] == key[i]) break;
+        c = t->core + j;
+        if (j == t->ncores) {
+            c->node = node[i];
+            c->cpu = (int *)malloc(MAXCPU*sizeof(int));
+            if (c->cpu == NULL) break;
+            t->ncores++;
+        }
+        c->cpu[c->ncpu++] = i;
+    }
+    qsort(t->core,t->ncores,sizeof(core_t),core_cmp);
+
+    for (j = 0; j < t->ncores; ++j)
+        if ((j == 0) || (t->core[j].node != t->core[j-1].node))
+            t->nnodes++;
+
+    if (t->ncores == 0) {
+        topology_exit(t);
+        t = NULL;
+    }
+
+    free((void *)usable);
+    free((void *)online);
+    free((void *)flag);
+    free((void *)node);
+    free((void *)key);
+    return t;
+}
+
+/* ---------------------------------------- */
+
+void topology_exit(topology_t *t)
+{
+    int i;
+    if (t == NULL) return;
+    if (t->core != NULL) {
+        for (i = 0; i < t->ncores; ++i)
+            free((void *)t->core[i].cpu);
+        free((void *)t->core);
+    }
+    free((void *)t);
+}
+
+/* ---------------------------------------- */
+
+char *topology_cpulist(topology_t *t, int first, int num)
+{
+    char *buf,*ptr;
+    const core_t *c;
+    int i,j,len;
+
+    if ((t == NULL) || (t->ncores < 1) || (num < 1)) return NULL;
+
+    len = 1;
+    for (i = 0; i < num; ++i)
+        len += 8*t->core[(first+i) % t->ncores].ncpu;
+    buf = (char *)malloc(len);
+    if (buf == NULL) return NULL;
+
+    ptr = buf;
+    for (i = 0; i < num; ++i) {
+        c = t->core + (first+i) % t->ncores;
+        for (j = 0; j < c->ncpu; ++j)
+            ptr += sprintf(ptr,"%s%d",(ptr == buf) ? "" : ",",c->cpu[j]);
+    }
+    *ptr = '\0';
+    return buf;
+}
+
+/* ---------------------------------------- */
+
+char *topology_slot(topology_t *t, int slot, int num, int nslots)
+{
+    int per;
+
+    if ((t == NULL) || (slot < 0) || (num < 1) || (nslots < 1)) return NULL;
+    per = t->ncores / nslots;
+    if (per < 1) per = 1;
+    if (num*per > t->ncores) return topology_cpulist(t,0,t->ncores);
+    return topology_cpulist(t,slot*per,num*per);
+}
+
+/* ---------------------------------------- */
+
+int topology_apply(const char *cpus)
+{
+    cpu_set_t mask;
+    char *flag;
+    int i,num;
+
+    if (cpus == NULL) return 1;
+    flag = (char *)calloc(MAXCPU,1);
+    if (flag == NULL) return 2;
+    parse_list(cpus,flag,MAXCPU);
+
+    CPU_ZERO(&mask);
+    num = 0;
+    for (i = 0; i < MAXCPU; ++i) {
+        if (!flag[i]) continue;
+        CPU_SET(i,&mask);
+        ++num;
+    }
+    free((void *)flag);
+    if (num == 0) return 3;
+    return (sched_setaffinity(0,sizeof(mask),&mask) == 0) ? 0 : 4;
+}
+
+/*
+ * Local Variables:
+ * c-basic-offset: 4
+ * auto-revert-buffer: 't
+ * compile-command: "make -k -C ../ fedora"
+ * End:
+ */
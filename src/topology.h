@@ -0,0 +1,70 @@
+
+/*
+ * Torque task list launcher tool.
+ *
+ * Copyright (c) 2015,2017 Axel Kohlmeyer <akohlmey@gmail.com>
+ */
+
+/* API for querying the CPU topology of the local node */
+
+#ifndef TL_TOPOLOGY_H
+#define TL_TOPOLOGY_H
+
+typedef struct {
+    int node;           /* NUMA node of core */
+    int ncpu;           /* number of hardware threads of core */
+    int *cpu;           /* logical CPU ids of hardware threads */
+} core_t;
+
+typedef struct {
+    int ncores;         /* number of usable cores */
+    int nnodes;         /* number of NUMA nodes with usable cores */
+    core_t *core;       /* usable cores ordered by NUMA node */
+} topology_t;
+
+/*! Read CPU topology from /sys/devices/system. Only CPUs the process
+ * may run on are considered. Cores are ordered so that consecutive
+ * cores are on the same NUMA node whenever possible.
+ * \return allocated topology struct or NULL on failure
+ */
+topology_t *topology_init();
+
+/*! Free topology struct
+ * \param t topology struct allocated by topology_init
+ */
+void topology_exit(topology_t *t);
+
+/*! Return list of CPUs of a range of cores
+ * \param t topology struct allocated by topology_init
+ * \param first index of first core, wraps around at number of cores
+ * \param num number of consecutive cores
+ * \return comma separated list of CPU ids to be freed by caller
+ */
+char *topology_cpulist(topology_t *t, int first, int num);
+
+/*! Return list of CPUs of a range of adjacent slots. The cores are
+ * divided evenly among the slots of the host, so multi-core slots stay
+ * NUMA local. With more slots than cores, slots share cores round-robin.
+ * \param t topology struct allocated by topology_init
+ * \param slot index of first slot on this host
+ * \param num number of adjacent slots
+ * \param nslots number of slots on this host
+ * \return comma separated list of CPU ids to be freed by caller
+ */
+char *topology_slot(topology_t *t, int slot, int num, int nslots);
+
+/*! Bind the calling process to a list of CPUs
+ * \param cpus comma separated list of CPU ids
+ * \return 0 if successful, other on failure
+ */
+int topology_apply(const char *cpus);
+
+#endif
+
+/*
+ * Local Variables:
+ * c-basic-offset: 4
+ * auto-revert-buffer: 't
+ * compile-command: "make -k -C ../ fedora"
+ * End:
+ */
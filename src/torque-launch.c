@@ -5,10 +5,13 @@
  * Copyright (c) 2015,2017 Axel Kohlmeyer <akohlmey@gmail.com>
  */
 
+#include <getopt.h>
+#include <signal.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #ifdef USE_SYSLOG
 #include <syslog.h>
@@ -16,53 +19,232 @@
 
 #include "task-mgr.h"
 #include "node-mgr.h"
+#include "queue-mgr.h"
+#include "stream.h"
+#include "bucket.h"
+#include "simulate.h"
+#include "topology.h"
 
 /** maximum length of line in joblist file */
 #define LINEBUFSZ 2048
 
+/** initial number of tasks to allocate, grows as needed */
+#define TASKLISTSZ 1024
+
 /** sleep time in seconds between scheduling/polling */
 #define SCHEDULE_INTERVAL 2
 
+/** default delay in seconds before retrying a failed task */
+#define RETRY_DELAY 30
+
+/** default number of upcoming tasks to stage input files for per host */
+#define STAGE_DEPTH 2
+
+/** initial launch rate in tasks per second when adapting to spawn latency */
+#define ADAPT_RATE 10.0
+
+/** upper limit of the adaptive launch rate in tasks per second without -R */
+#define ADAPT_MAXRATE 1000.0
+
+/** interval in seconds between adjustments of the launch rate */
+#define ADAPT_INTERVAL 1
+
+/** time in seconds between polls for events when we must not block */
+#define POLL_INTERVAL 0.1
+
+/** time in seconds to wait when all hosts reached their launch limit */
+#define THROTTLE_INTERVAL 0.05
+
+/* options without short form */
+#define OPT_SIMULATE 256
+#define OPT_HISTORY  257
+#define OPT_RUNTIME  258
+#define OPT_BIND     259
+#define OPT_TASK     260
+
+/** maximum length of host name */
+#define HOSTNAMESZ 256
+
+static struct option longopts[] = {
+    {"simulate", required_argument, NULL, OPT_SIMULATE},
+    {"history",  required_argument, NULL, OPT_HISTORY},
+    {"runtime",  required_argument, NULL, OPT_RUNTIME},
+    /* internal options for binding tasks on their host */
+    {"bind",     required_argument, NULL, OPT_BIND},
+    {"task",     required_argument, NULL, OPT_TASK},
+    {NULL, 0, NULL, 0}
+};
+
 
 #ifdef USE_SYSLOG
 const char *logname = "torque-launch";
 const char *pbsjobid = "(unknown)";
 #endif
 
+/* set when the job is killed, e.g. at the end of its walltime */
+static volatile sig_atomic_t terminated = 0;
+
+static void terminate(int sig)
+{
+    terminated = 1;
+}
+
 /* ---------------------------------------- */
 
 static int usage(const char *argv0)
 {
     printf("\nUsage:  %s [-f|-r|-m|-c <center task #>] "
-           "[-p <checkpoint filename>] <joblist filename>\n"
+           "[-p <checkpoint filename>]\n"
+           "        [-s <shared state filename> [-b <batch size>]]\n"
+           "        [-a <max attempts> [-e <exit codes>] [-d <delay>]]\n"
+           "        [-S <scratch directory> [-k <depth>]] [-B [-l]]\n"
+           "        [-R <rate>] [-H <rate>] [-A <latency>]\n"
+           "        [--simulate=<slots> [--history=<file>] "
+           "[--runtime=<seconds>]]\n"
+           "        <joblist filename>\n"
            "Meaning of flags:\n"
            " -f   : process tasks in forward order (default)\n"
            " -r   : process tasks in reverse order\n"
            " -m   : process tasks starting in the middle\n"
            " -c # : like -mid but start with task #\n"
-           " -p name : name of checkpoint file\n",argv0);
+           " -p name : name of checkpoint file\n"
+           " -s name : share task list with other jobs through state file\n"
+           " -b # : number of tasks to claim at once from shared task list\n"
+           "        (default: number of processors)\n"
+           " -a # : maximum number of attempts for failed tasks (default: 1)\n"
+           " -e list : comma separated exit codes to retry (default: all)\n"
+           " -d # : delay in seconds before first retry (default: %d),\n"
+           "        doubled with every following retry\n"
+           " -S dir : stage input files of tasks to node-local directory\n"
+           " -k # : number of upcoming tasks to stage per host "
+           "(default: %d)\n"
+           " -B   : bind tasks to CPU cores, NUMA local for multi-core slots\n"
+           " -l   : report CPU binding of tasks in event log\n"
+           " -R # : maximum number of task launches per second "
+           "(default: unlimited)\n"
+           " -H # : maximum number of task launches per second and host\n"
+           "        (default: unlimited)\n"
+           " -A # : adapt launch rate to keep spawn latency below # seconds,\n"
+           "        starting at %g launches per second or the -R value\n"
+           " --simulate=list : predict makespan for a comma separated list\n"
+           "        of slot counts or ranges like 16-256:16 without running\n"
+           " --history=name : file with runtimes of previous runs, "
+           "one line\n"
+           "        per task: runtime in seconds followed by the command\n"
+           " --runtime=# : runtime of tasks without \"#@ runtime=#\" "
+           "annotation\n"
+           "        or history entry (default: average of known runtimes)\n",
+           argv0,RETRY_DELAY,STAGE_DEPTH,ADAPT_RATE);
     return 1;
 }
 
 /* ---------------------------------------- */
 
+/* binding mode, run on the host of a task: bind to the CPU cores of
+   the slots I-J (or slot I) out of N according to the topology and
+   cpuset of this host, then execute the task. if binding fails, the
+   task runs unbound. */
+static int bind_exec(const char *slot, int tasknum, int report, char **cmd)
+{
+    topology_t *topo;
+    char host[HOSTNAMESZ];
+    char *cpus;
+    int i,j,num;
+
+    if (sscanf(slot,"%d-%d/%d",&i,&j,&num) != 3) {
+        j = -1;
+        if (sscanf(slot,"%d/%d",&i,&num) == 2) j = i;
+    }
+    if ((j < i) || (i < 0) || (num < 1) || (cmd[0] == NULL)) {
+        fprintf(stderr,"Invalid binding request: %s\n",slot);
+        return 1;
+    }
+    if (gethostname(host,HOSTNAMESZ) != 0) strcpy(host,"(unknown)");
+    host[HOSTNAMESZ-1] = '\0';
+
+    topo = topology_init();
+    cpus = topology_slot(topo,i,j-i+1,num);
+
+#ifdef USE_SYSLOG
+    pbsjobid = getenv("PBS_JOBID");
+    openlog(logname,LOG_PID|LOG_ODELAY,LOG_LOCAL2);
+#endif
+    if ((cpus == NULL) || (topology_apply(cpus) != 0)) {
+        fprintf(stderr,"torque-launch: binding task %d to CPUs %s on "
+                "host %s failed, running it unbound\n",tasknum,
+                (cpus != NULL) ? cpus : "(unknown)",host);
+#ifdef USE_SYSLOG
+        syslog(LOG_WARNING,"{\"job_id\": %s, \"event\": \"bind_failed\","
+               "\"task_id\": %d, \"host\": \"%s\"}",pbsjobid,tasknum,host);
+#endif
+    } else if (report) {
+#ifdef USE_SYSLOG
+        syslog(LOG_INFO,"{\"job_id\": %s, \"event\": \"task_bind\","
+               "\"task_id\": %d, \"host\": \"%s\", \"cpus\": \"%s\"}",
+               pbsjobid,tasknum,host,cpus);
+#else
+        printf("Task %d bound to CPUs %s on host %s\n",tasknum,cpus,host);
+        fflush(stdout);
+#endif
+    }
+#ifdef USE_SYSLOG
+    closelog();
+#endif
+    free((void *)cpus);
+    topology_exit(topo);
+
+    execv(cmd[0],cmd);
+    perror("Error executing task");
+    return 127;
+}
+
+/* ---------------------------------------- */
+
 int main(int argc, char **argv)
 {
-    FILE *fp;
+    stream_t *fp;
     task_mgr_t *t;
     node_mgr_t *n;
-    int i,opt,reorderflag,center,nlines,nnodes;
-    const char *ptr,*checkpoint;
+    queue_mgr_t *q;
+    sim_t *sim;
+    task_t *k;
+    int opt,reorderflag,center,nlines,nnodes,batch,maxtry,delay,wait,depth;
+    int bind,bindlog,limited;
+    double rate,hostrate,target,throttle,runtime;
+    time_t lastadapt;
+    bucket_t launch;
+    struct sigaction sa;
+    const char *ptr,*checkpoint,*shared,*codes,*scratch,*simulate,*history;
+    const char *bindslot;
+    int bindtask;
     char linebuf[LINEBUFSZ];
 
-    if ((argc < 2) || (argc > 6))
+    if (argc < 2)
         return usage(argv[0]);
 
     reorderflag = REORDER_NOTSET;
     center = -1;
     checkpoint = NULL;
-
-    while ((opt = getopt(argc,argv,"frmc:p:")) != -1) {
+    shared = NULL;
+    batch = 0;
+    maxtry = 1;
+    codes = NULL;
+    delay = RETRY_DELAY;
+    scratch = NULL;
+    depth = STAGE_DEPTH;
+    bind = 0;
+    bindlog = 0;
+    rate = 0.0;
+    hostrate = 0.0;
+    target = 0.0;
+    simulate = NULL;
+    history = NULL;
+    runtime = 0.0;
+    bindslot = NULL;
+    bindtask = -1;
+
+    while ((opt = getopt_long(argc,argv,"frmc:p:s:b:a:e:d:S:k:BlR:H:A:",
+                              longopts,NULL)) != -1) {
         switch (opt) {
 
           case 'f':
@@ -91,44 +273,126 @@ int main(int argc, char **argv)
               checkpoint = strdup(optarg);
               break;
 
+          case 's':
+              shared = strdup(optarg);
+              break;
+
+          case 'b':
+              batch = atoi(optarg);
+              if (batch < 1) return usage(argv[0]);
+              break;
+
+          case 'a':
+              maxtry = atoi(optarg);
+              if (maxtry < 1) return usage(argv[0]);
+              break;
+
+          case 'e':
+              codes = strdup(optarg);
+              break;
+
+          case 'd':
+              delay = atoi(optarg);
+              if (delay < 0) return usage(argv[0]);
+              break;
+
+          case 'S':
+              scratch = strdup(optarg);
+              break;
+
+          case 'k':
+              depth = atoi(optarg);
+              if (depth < 1) return usage(argv[0]);
+              break;
+
+          case 'B':
+              bind = 1;
+              break;
+
+          case 'l':
+              bindlog = 1;
+              break;
+
+          case 'R':
+              rate = atof(optarg);
+              if (rate <= 0.0) return usage(argv[0]);
+              break;
+
+          case 'H':
+              hostrate = atof(optarg);
+              if (hostrate <= 0.0) return usage(argv[0]);
+              break;
+
+          case 'A':
+              target = atof(optarg);
+              if (target <= 0.0) return usage(argv[0]);
+              break;
+
+          case OPT_SIMULATE:
+              simulate = strdup(optarg);
+              break;
+
+          case OPT_HISTORY:
+              history = strdup(optarg);
+              break;
+
+          case OPT_RUNTIME:
+              runtime = atof(optarg);
+              if (runtime <= 0.0) return usage(argv[0]);
+              break;
+
+          case OPT_BIND:
+              bindslot = optarg;
+              break;
+
+          case OPT_TASK:
+              bindtask = atoi(optarg);
+              break;
+
           default:
               return usage(argv[0]);
         }
     }
 
     if (optind >= argc) return usage(argv[0]);
+    if (bindslot != NULL)
+        return bind_exec(bindslot,bindtask,bindlog,argv+optind);
     if (reorderflag == REORDER_NOTSET) reorderflag = REORDER_FORWARD;
 
-    fp = fopen(argv[optind],"r");
+    /* read task list in a single pass, since decompressing a
+       compressed task list twice would be expensive */
+    fp = stream_open(argv[optind]);
     if (!fp) {
         perror("Error opening job list file:");
         return 2;
     }
 
-    /* count number of lines in file */
-    nlines = 0;
-    while (!feof(fp) && !ferror(fp)) {
-        if (fgets(linebuf,LINEBUFSZ,fp) != NULL)
-            ++nlines;
-    }
-
     /* initialize task manager */
-    t = task_mgr_init(nlines);
+    t = task_mgr_init(TASKLISTSZ);
     if (t == NULL) {
-        printf("Error allocating internal data for %d tasks.\n",nlines);
+        printf("Error allocating internal data for %d tasks.\n",TASKLISTSZ);
+        stream_close(fp);
         return 3;
     }
-    rewind(fp);
-    for (i = 0; i < nlines; ++i) {
-        ptr = fgets(linebuf,LINEBUFSZ,fp);
-        if (ptr == NULL) break;
+    nlines = 0;
+    while ((ptr = stream_gets(linebuf,LINEBUFSZ,fp)) != NULL) {
+        ++nlines;
         if (task_mgr_add(t,ptr) != 0) {
-            printf("Error adding line %d of %d to task list.\n",i+1,nlines);
+            printf("Error adding line %d to task list.\n",nlines);
+            stream_close(fp);
             task_mgr_exit(t);
             return 4;
         }
     }
-    fclose(fp);
+    /* never process a partial task list, e.g. from a damaged checkpoint */
+    if (stream_error(fp)) {
+        printf("Error reading task list file '%s' after line %d.\n",
+               argv[optind],nlines);
+        stream_close(fp);
+        task_mgr_exit(t);
+        return 4;
+    }
+    stream_close(fp);
     printf("Found %d tasks in task list file '%s'.\n",
            task_mgr_nall(t),argv[optind]);
 
@@ -145,6 +409,29 @@ int main(int argc, char **argv)
     /* reorder tasks, if requested */
     t = task_mgr_reorder(t,reorderflag,center);
 
+    if (task_mgr_retry(t,maxtry,codes,delay) != 0) {
+        printf("Invalid list of exit codes to retry: %s\n",codes);
+        task_mgr_exit(t);
+        return usage(argv[0]);
+    }
+    if (maxtry > 1)
+        printf("Retrying failed tasks up to %d times after %d seconds.\n",
+               maxtry-1,delay);
+
+    /* predict makespan instead of running the tasks */
+    if (simulate != NULL) {
+        sim = sim_init(t,history,runtime,rate);
+        if (sim == NULL) {
+            printf("Error collecting runtime estimates of tasks.\n");
+            task_mgr_exit(t);
+            return 8;
+        }
+        opt = sim_report(sim,simulate);
+        sim_exit(sim);
+        task_mgr_exit(t);
+        return (opt != 0) ? 9 : 0;
+    }
+
 #ifdef USE_SYSLOG
     pbsjobid = getenv("PBS_JOBID");
     openlog(logname,LOG_PID|LOG_ODELAY,LOG_LOCAL2);
@@ -162,31 +449,149 @@ int main(int argc, char **argv)
     nnodes = node_mgr_nall(n);
     printf("Distributing tasks to %d processors.\n",nnodes);
 
-    /* schedule tasks to node when they become available */
-    while (task_mgr_todo(t) > 0) {
+    if (bind && (node_mgr_binding(n,bindlog) != 0))
+        printf("Could not set up CPU binding. Tasks will not be bound.\n");
+
+    if (scratch != NULL) {
+        if (node_mgr_staging(n,scratch,depth) != 0) {
+            printf("Error setting up staging to '%s'.\n",scratch);
+            node_mgr_exit(n);
+            task_mgr_exit(t);
+            return 7;
+        }
+        printf("Staging input files for %d tasks per host to '%s'.\n",
+               depth,scratch);
+    }
+
+    /* limit the rate of task launches, so that a large reservation
+       does not flood the MOM daemons and the shared file system */
+    if (hostrate > 0.0) {
+        node_mgr_limit(n,hostrate);
+        printf("Launching at most %g tasks per second on each host.\n",
+               hostrate);
+    }
+    if (target > 0.0) {
+        bucket_init(&launch,((rate > 0.0) && (rate < ADAPT_RATE))
+                    ? rate : ADAPT_RATE);
+        printf("Adapting launch rate to keep spawn latency below %g s.\n",
+               target);
+    } else {
+        bucket_init(&launch,rate);
+        if (rate > 0.0)
+            printf("Launching at most %g tasks per second.\n",rate);
+    }
+    lastadapt = time(NULL);
+    limited = 0;
+
+    /* tasks are claimed in batches from the shared task list */
+    q = NULL;
+    if (shared != NULL) {
+        if (batch < 1) batch = nnodes;
+        q = queue_mgr_init(shared,task_mgr_nall(t),batch);
+        if (q == NULL) {
+            printf("Error accessing shared state file '%s'.\n",shared);
+            node_mgr_exit(n);
+            task_mgr_exit(t);
+            return 6;
+        }
+        task_mgr_clear(t);
+        node_mgr_sharing(n,q);
+        printf("Sharing task list through '%s' in batches of %d tasks.\n",
+               shared,batch);
+    }
+
+    /* on SIGTERM, hand back claimed tasks to other jobs right away */
+    memset(&sa,0,sizeof(sa));
+    sa.sa_handler = terminate;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM,&sa,NULL);
+
+    /* schedule tasks to node when they become available. tasks may
+       be queued again while others are still running, so we are only
+       done when nothing is pending and nothing is running anymore.
+       with a shared task list, we also keep going while other jobs
+       hold unfinished tasks, so we can take over if they die. */
+    while (!terminated) {
         task_mgr_chkpnt(t,checkpoint);
 
-        /* task available, node available -> launch task */
+        /* refill pending tasks from the shared task list */
+        if ((task_mgr_nqueue(t) == 0) && (node_mgr_nidle(n) > 0))
+            queue_mgr_claim(q,t);
+        queue_mgr_sync(q,t);
+        if ((task_mgr_todo(t) == 0) && (node_mgr_nrun(n) == 0)
+            && (queue_mgr_others(q) == 0))
+            break;
+
+        if ((node_mgr_nidle(n) == 0) && (node_mgr_nrun(n) == 0)) {
+            printf("No usable processors left. Aborting\n");
+            break;
+        }
+
+        /* slow down launches when spawns take longer than desired */
+        if ((target > 0.0) && (time(NULL) - lastadapt >= ADAPT_INTERVAL)) {
+            lastadapt = time(NULL);
+            bucket_adapt(&launch,node_mgr_latency(n),target,
+                         (rate > 0.0) ? rate : ADAPT_MAXRATE,limited);
+            limited = 0;
+        }
+
+        /* task available, node available -> launch task, if admitted.
+           with a shared task list we must not block in tm_poll(), since
+           the heartbeat has to be written even while all tasks run. */
+        wait = (q == NULL);
+        throttle = 0.0;
         if ((task_mgr_todo(t) > 0) && (node_mgr_nidle(n) > 0)) {
-            if (node_mgr_run(n,task_mgr_next(t)) == TM_ERROR_NODE) {
-                printf("Error scheduling pending task. Aborting\n");
-                break;
+            if (!bucket_ready(&launch)) {
+                /* do not block, so we can launch when the next token is due */
+                throttle = bucket_delay(&launch);
+                wait = 0;
+                limited = 1;
+            } else if (node_mgr_nready(n) == 0) {
+                throttle = THROTTLE_INTERVAL;
+                wait = 0;
+            } else {
+                k = node_mgr_next(n,t);
+                if (k == NULL) {
+                    /* no task fits on the idle slots or only retries
+                       are left: do not block, a delay may expire */
+                    throttle = THROTTLE_INTERVAL;
+                    wait = 0;
+                } else if (node_mgr_run(n,k) == TM_ERROR_NODE) {
+                    printf("Error scheduling pending task. Aborting\n");
+                    break;
+                } else {
+                    bucket_take(&launch);
+                }
             }
         }
-       
+
+        /* copy input files of upcoming tasks while others run */
+        node_mgr_prefetch(n,t);
+
         /* process pending events */
-        if (node_mgr_schedule(n)) continue;
-        sleep(SCHEDULE_INTERVAL);
+        if (node_mgr_schedule(n,t,wait)) continue;
+        if ((throttle == 0.0) && (q != NULL)) throttle = POLL_INTERVAL;
+        if (throttle > 0.0) {
+            if (throttle > SCHEDULE_INTERVAL) throttle = SCHEDULE_INTERVAL;
+            usleep((useconds_t)(1.0e6*throttle));
+        } else sleep(SCHEDULE_INTERVAL);
     }
 
     /* wait for remaining calculations to complete */
-    while (node_mgr_nidle(n) < nnodes) {
+    while (!terminated && (node_mgr_nrun(n) > 0)) {
         task_mgr_chkpnt(t,checkpoint);
-        if (node_mgr_schedule(n)) continue;
-        sleep(SCHEDULE_INTERVAL);
+        queue_mgr_sync(q,t);
+        if (node_mgr_schedule(n,t,(q == NULL))) continue;
+        if (q != NULL) usleep((useconds_t)(1.0e6*POLL_INTERVAL));
+        else sleep(SCHEDULE_INTERVAL);
     }
 
+    if (terminated)
+        printf("Terminated with %d tasks still running.\n",
+               node_mgr_nrun(n));
+
     /* shut down and clean up */
+    queue_mgr_exit(q,t);
     node_mgr_exit(n);
     task_mgr_exit(t);
 
@@ -194,7 +599,8 @@ int main(int argc, char **argv)
     syslog(LOG_INFO,"{\"job_id\": %s, \"event\": \"exit\"}",pbsjobid);
     closelog();
 #endif
-    if (checkpoint != NULL) unlink(checkpoint);
+    /* keep the checkpoint, if we were killed before completion */
+    if ((checkpoint != NULL) && !terminated) unlink(checkpoint);
 
     return 0;
 }